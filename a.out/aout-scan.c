@@ -0,0 +1,282 @@
+/*
+ * Classify the a.out binaries in a tree of files, without running them.
+ * License: GPLv2
+ *
+ * Every regular file under each PATH has only its 32-byte header read,
+ * with pread(), and a.out binaries are listed with their format,
+ * segment sizes and whether the aout loader could run them here:
+ *
+ *   ok           runnable as-is
+ *   relocatable  linked below vm.mmap_min_addr, but can be moved up
+ *   blocked      linked below vm.mmap_min_addr
+ *   short        the file is shorter than its header says
+ *   foreign      identified, but not for ia32
+ *
+ * Directories are walked and files classified by a pool of threads, so
+ * output lines come in no particular order.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "aout.h"
+
+/* A file or directory still to be looked at. */
+struct scan_item {
+	char *path;
+	unsigned char d_type;	/* DT_UNKNOWN if it needs an lstat() */
+	struct scan_item *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct scan_item *items;
+	/* Items queued or being worked on; the scan ends at zero. */
+	unsigned long pending;
+	/* Counts per aout_formats[] entry, and of everything else. */
+	unsigned long found[AOUT_NR_FORMATS];
+	unsigned long files, other;
+} scan = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int list_all;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-a] [-j THREADS] PATH ...\n", prog);
+	fprintf(stderr, "  -a, --all         also list files that aren't a.out binaries\n");
+	fprintf(stderr, "  -j, --jobs=N      scan with N threads (default: one per CPU)\n");
+}
+
+/* Takes ownership of "path". */
+static void queue_item(char *path, unsigned char d_type)
+{
+	struct scan_item *item = malloc(sizeof(*item));
+
+	if (!item) {
+		perror("malloc");
+		exit(1);
+	}
+	item->path = path;
+	item->d_type = d_type;
+
+	pthread_mutex_lock(&scan.lock);
+	/* Depth first, so the queue stays about as deep as the tree. */
+	item->next = scan.items;
+	scan.items = item;
+	scan.pending++;
+	pthread_cond_signal(&scan.cond);
+	pthread_mutex_unlock(&scan.lock);
+}
+
+static void scan_dir(const char *path)
+{
+	struct dirent *ent;
+	size_t len = strlen(path);
+	char *child;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return;
+	}
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_DIR &&
+		    ent->d_type != DT_REG)
+			continue;
+		child = malloc(len + strlen(ent->d_name) + 2);
+		if (!child) {
+			perror("malloc");
+			exit(1);
+		}
+		sprintf(child, "%s/%s", path, ent->d_name);
+		queue_item(child, ent->d_type);
+	}
+	closedir(dir);
+}
+
+static const char *classify(const struct aout_format *fmt,
+			    const struct a_out *aout, off_t size)
+{
+	if (!fmt->runnable)
+		return "foreign";
+	if ((uint64_t)fmt->txtoff + aout->a_text + aout->a_data +
+	    aout->a_trsize + aout->a_drsize + aout->a_syms > size)
+		return "short";
+	if (fmt->load_addr >= mmap_min_addr())
+		return "ok";
+	if (aout->a_trsize || aout->a_drsize)
+		return "relocatable";
+	return "blocked";
+}
+
+static void scan_file(const char *path)
+{
+	unsigned char raw[sizeof(struct a_out)];
+	const struct aout_format *fmt = NULL;
+	struct a_out aout;
+	struct stat info;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(path);
+		return;
+	}
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+	    pread(fd, raw, sizeof(raw), 0) == sizeof(raw))
+		fmt = aout_format(raw, &aout);
+	close(fd);
+
+	pthread_mutex_lock(&scan.lock);
+	scan.files++;
+	if (fmt)
+		scan.found[fmt - aout_formats]++;
+	else
+		scan.other++;
+	pthread_mutex_unlock(&scan.lock);
+
+	/* One printf() per line: stdio keeps lines from interleaving. */
+	if (fmt)
+		printf("%-6s %-6s %10u %10u %10u %8u %8u 0x%08x %-11s %s\n",
+		       fmt->machine, fmt->name, aout.a_text, aout.a_data,
+		       aout.a_bss, aout.a_syms, aout.a_trsize + aout.a_drsize,
+		       aout.a_entry, classify(fmt, &aout, info.st_size), path);
+	else if (list_all)
+		printf("%-6s %-6s %10s %10s %10s %8s %8s %10s %-11s %s\n",
+		       "-", "-", "-", "-", "-", "-", "-", "-", "-", path);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_item *item;
+	struct stat info;
+
+	for (;;) {
+		pthread_mutex_lock(&scan.lock);
+		while (!scan.items && scan.pending)
+			pthread_cond_wait(&scan.cond, &scan.lock);
+		item = scan.items;
+		if (item)
+			scan.items = item->next;
+		pthread_mutex_unlock(&scan.lock);
+		if (!item)
+			return NULL;
+
+		if (item->d_type == DT_UNKNOWN) {
+			if (lstat(item->path, &info) < 0)
+				perror(item->path);
+			else if (S_ISDIR(info.st_mode))
+				item->d_type = DT_DIR;
+			else if (S_ISREG(info.st_mode))
+				item->d_type = DT_REG;
+		}
+		if (item->d_type == DT_DIR)
+			scan_dir(item->path);
+		else if (item->d_type == DT_REG)
+			scan_file(item->path);
+
+		free(item->path);
+		free(item);
+
+		pthread_mutex_lock(&scan.lock);
+		/* The last one out wakes everyone up to leave. */
+		if (--scan.pending == 0)
+			pthread_cond_broadcast(&scan.cond);
+		pthread_mutex_unlock(&scan.lock);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "all",	no_argument,		NULL, 'a' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "jobs",	required_argument,	NULL, 'j' },
+		{ }
+	};
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *threads;
+	unsigned int i;
+	int opt, err;
+	char *path;
+
+	while ((opt = getopt_long(argc, argv, "ahj:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			list_all = 1;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (jobs < 1)
+		jobs = 1;
+
+	/* Before any threads start: see mmap_min_addr(). */
+	mmap_min_addr();
+
+	for (i = optind; i < argc; i++) {
+		path = strdup(argv[i]);
+		if (!path) {
+			perror("strdup");
+			return 1;
+		}
+		queue_item(path, DT_UNKNOWN);
+	}
+
+	printf("%-6s %-6s %10s %10s %10s %8s %8s %10s %-11s %s\n",
+	       "arch", "format", "text", "data", "bss", "syms", "relocs",
+	       "entry", "status", "path");
+
+	threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&threads[i], NULL, scan_worker, NULL);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return 1;
+		}
+	}
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	fflush(stdout);
+	fprintf(stderr, "# %lu files, vm.mmap_min_addr = %lu\n", scan.files,
+		mmap_min_addr());
+	for (i = 0; i < AOUT_NR_FORMATS; i++)
+		if (scan.found[i])
+			fprintf(stderr, "# %-6s %-6s %lu\n", aout_formats[i].machine,
+				aout_formats[i].name, scan.found[i]);
+	fprintf(stderr, "# other         %lu\n", scan.other);
+
+	return 0;
+}
@@ -1,5 +1,5 @@
 /*
- * Execute a static QMAGIC or ZMAGIC ia32 a.out binary.
+ * Execute a static ia32 a.out binary (QMAGIC, ZMAGIC, NMAGIC or OMAGIC).
  * Copyright 2022 Kees Cook <keescook@chromium.org>
  * Copyright 2023 James Jones <atari@theinnocuous.com>
  * License: GPLv2
@@ -7,6 +7,8 @@
  * For a more complete solution, see also:
  * https://github.com/siegfriedpammer/run-aout
  */
+#define _GNU_SOURCE
+#include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,51 +18,211 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <sys/auxv.h>
+#include <sys/random.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
-/* Locally define the stuff from a.out.h since that file may disappear. */
-struct a_out
-{
-	unsigned int a_info;	/* machine type, magic, etc */
-	unsigned int a_text;	/* text size */
-	unsigned int a_data;	/* data size */
-	unsigned int a_bss;	/* desired bss size */
-	unsigned int a_syms;	/* symbol table size */
-	unsigned int a_entry;	/* entry address */
-	unsigned int a_trsize;	/* text relocation size */
-	unsigned int a_drsize;	/* data relocation size */
-};
-
-#define Q_MAGIC_MAGIC		(0x006400ccUL)
-#define Q_MAGIC_TXT_FDOFF	0x0000
-#define Q_MAGIC_LOAD_ADDR	0x1000
+#include "aout.h"
 
-#define Z_MAGIC_MAGIC		(0x0064010bUL)
-#define Z_MAGIC_TXT_FDOFF	0x0400
-#define Z_MAGIC_LOAD_ADDR	0x0000
+/* How long a --batch=unix:PATH client gets to send its job line. */
+#define BATCH_LINE_TIMEOUT_MS	1000
 
-#define MMAP_MIN_ADDR_PATH	"/proc/sys/vm/mmap_min_addr"
+#define HPAGE_SIZE_PATH		"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
 
+#define ALIGN_DOWN(x, a)	(typeof(x))((unsigned long)(x) & ~((unsigned long)(a) - 1))
 #define ALIGN(x, a)		ALIGN_MASK(x, (unsigned long)(a) - 1)
 #define ALIGN_MASK(x, mask)	(typeof(x))(((unsigned long)(x) + (mask)) & ~(mask))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof(*(a)))
 
-static void check_mmap_min_addr(unsigned long load_addr, const char *name)
-{
+/* A validated a.out binary, ready to be mapped at its load address. */
+struct aout_image {
+	char *path;
+	struct a_out aout;
+	struct stat info;
+	const struct aout_format *format;
+	const char *file_type;
+	unsigned long load_addr;
+	unsigned int txtoff;
+	/* Where data starts, relative to text, once loaded. */
+	unsigned int data_off;
+	/* How far the image was moved from load_addr to fit. */
+	unsigned long bias;
+	int fd;
+	/* The whole file, when the image has to be copied into place. */
+	void *disk_image;
+	struct aout_image *next;
+};
+
+/* One line of a --batch job list: an a.out path and its arguments. */
+struct aout_job {
+	struct aout_image *image;
+	int argc;
+	char **argv;
+};
+
+/* A text, data or bss symbol, for naming the address of a crash. */
+struct aout_symbol {
 	unsigned long addr;
+	const char *name;
+};
+
+/* Sorted by address. Lives in its own mapping, clear of the binary. */
+static struct aout_symbol *symbols;
+static unsigned int nr_symbols;
+static unsigned long symbols_start, symbols_end;
+
+/*
+ * AOUT_TRACE: CLOCK_MONOTONIC timestamps for each loader phase, written
+ * as one line just before the jump. With tracing off, each TRACE() is
+ * a single untaken branch.
+ */
+#define TRACE_MAX_MARKS		16
+
+struct trace_mark {
+	const char *phase;
+	uint64_t ns;
+};
+
+static int trace_fd = -1;
+static struct trace_mark trace_marks[TRACE_MAX_MARKS];
+static unsigned int trace_nr_marks;
+
+#define TRACE(phase)	do {					\
+	if (trace_fd >= 0)					\
+		trace_mark(phase);				\
+} while (0)
+
+static int pagesize;
+static int index_syms;
+static int populate_flags;
+static int stack_prot = PROT_READ | PROT_WRITE;
+static rlim_t stack_size;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-x|--exec-stack] a.out [arg ...]\n", prog);
+	fprintf(stderr, "       %s [-x|--exec-stack] --batch=JOBS\n", prog);
+	fprintf(stderr, "  -x, --exec-stack  map the stack executable, for binaries that need it\n");
+	fprintf(stderr, "  -s, --symbols     name the crashing function from the binary's symbol table\n");
+	fprintf(stderr, "  -p, --populate    read the whole image in before starting, instead of\n");
+	fprintf(stderr, "                    faulting it in page by page (unshares file pages)\n");
+	fprintf(stderr, "  -b, --batch=JOBS  run \"a.out [arg ...]\" lines from the file JOBS ('-' for\n");
+	fprintf(stderr, "                    stdin), or from connections to the Unix socket unix:PATH\n");
+	fprintf(stderr, "\nEnvironment:\n");
+	fprintf(stderr, "  AOUT_TRACE=1      print each loader phase's duration (ns) to stderr\n");
+	fprintf(stderr, "  AOUT_TRACE=fd:N   write those durations to file descriptor N instead\n");
+}
+
+static void trace_mark(const char *phase)
+{
+	struct timespec ts;
+
+	if (trace_nr_marks == TRACE_MAX_MARKS)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	trace_marks[trace_nr_marks].phase = phase;
+	trace_marks[trace_nr_marks].ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	trace_nr_marks++;
+}
+
+/* (Re)start tracing, if AOUT_TRACE asks for it. */
+static void trace_init(void)
+{
+	const char *env = getenv("AOUT_TRACE");
+
+	if (!env)
+		return;
+	trace_fd = strncmp(env, "fd:", 3) ? STDERR_FILENO : atoi(env + 3);
+	trace_nr_marks = 0;
+	TRACE("start");
+}
+
+/* One line, one write(), so traces from concurrent jobs don't mix. */
+static void trace_emit(const char *path)
+{
+	char buf[1024];
+	size_t len = 0;
+	unsigned int i;
+
+	len += snprintf(buf, sizeof(buf), "aout-trace: %s", path);
+	for (i = 1; i < trace_nr_marks && len < sizeof(buf); i++)
+		len += snprintf(buf + len, sizeof(buf) - len, " %s=%llu",
+				trace_marks[i].phase,
+				(unsigned long long)(trace_marks[i].ns -
+						     trace_marks[i - 1].ns));
+	if (len < sizeof(buf))
+		len += snprintf(buf + len, sizeof(buf) - len, " total=%llu\n",
+				(unsigned long long)(trace_marks[trace_nr_marks - 1].ns -
+						     trace_marks[0].ns));
+	if (len >= sizeof(buf)) {
+		len = sizeof(buf);
+		buf[len - 1] = '\n';
+	}
+	if (write(trace_fd, buf, len) < 0)
+		return;
+}
+
+/* Read a number from a sysctl or sysfs file, or 0 if that fails. */
+static unsigned long read_ulong(const char *path)
+{
 	char buf[128], *result;
 	FILE *proc;
 
-	proc = fopen(MMAP_MIN_ADDR_PATH, "r");
+	proc = fopen(path, "r");
 	if (!proc)
-		return;
+		return 0;
 	result = fgets(buf, sizeof(buf), proc);
 	fclose(proc);
 	if (!result)
+		return 0;
+
+	return strtoul(result, NULL, 0);
+}
+
+/* Size of a transparent huge page, or 0 if the kernel has none. */
+static unsigned long hugepage_size(void)
+{
+	static unsigned long size;
+	static int cached;
+
+	if (cached)
+		return size;
+	cached = 1;
+
+	size = read_ulong(HPAGE_SIZE_PATH);
+	return size;
+}
+
+/*
+ * Ask for huge pages on the part of [start, end) that whole huge pages
+ * can cover. Anonymous memory only; it's just a hint, so errors (such
+ * as THP being disabled) are ignored.
+ */
+static void advise_hugepages(void *start, void *end)
+{
+	unsigned long size = hugepage_size();
+	void *from, *to;
+
+	if (!size)
 		return;
+	from = ALIGN(start, size);
+	to = ALIGN_DOWN(end, size);
+	if (to > from)
+		madvise(from, to - from, MADV_HUGEPAGE);
+}
+
+static void check_mmap_min_addr(unsigned long load_addr, const char *name)
+{
+	unsigned long addr = mmap_min_addr();
 
-	addr = strtoul(result, NULL, 0);
 	if (addr <= load_addr)
 		return;
 
@@ -70,154 +232,626 @@ static void check_mmap_min_addr(unsigned long load_addr, const char *name)
 		load_addr);
 }
 
-int main(int argc, char *argv[], char *envp[])
+/* Did the binary keep its relocations, so it can be moved? */
+static int image_is_relocatable(const struct aout_image *img)
 {
-	void *disk_image;
-	struct a_out aout_local;
-	struct a_out *aout;
-	struct stat info;
-	unsigned char *image, *image_end, *bss, *bss_end, *stack, *stack_end;
-	char **p;
-	unsigned long *sp;
-	struct rlimit rlim;
-	int pagesize;
-	int fd;
-	int argc_copy, envc_copy;
-	unsigned int txtoff;
-	unsigned long load_addr;
-	const char *file_type;
-	char **argv_copy, **envp_copy;
-	size_t image_bytes;
+	return img->aout.a_trsize || img->aout.a_drsize;
+}
 
-	if (sizeof(void *) != 4) {
-		fprintf(stderr, "Eek: I was compiled in 64-bit mode. Please build with -m32.\n");
-		return 1;
+/* Can the image be mapped straight from the file? */
+static int image_is_aligned(const struct aout_image *img)
+{
+	return img->load_addr % pagesize == 0 && img->txtoff % pagesize == 0 &&
+	       img->data_off == img->aout.a_text;
+}
+
+static void close_image(struct aout_image *img)
+{
+	if (img->disk_image) {
+		munmap(img->disk_image, img->info.st_size);
+		img->disk_image = NULL;
+	}
+	if (img->fd >= 0) {
+		close(img->fd);
+		img->fd = -1;
 	}
+}
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s a.out [arg ...]\n", argv[0]);
-		return 1;
+/* Open "path" and validate its a.out header. */
+static int open_image(struct aout_image *img, const char *path)
+{
+	struct a_out *aout = &img->aout;
+	unsigned char raw[sizeof(*aout)];
+
+	img->fd = open(path, O_RDONLY);
+	if (img->fd < 0) {
+		perror(path);
+		return -1;
 	}
 
-	fd = open(argv[1], O_RDONLY);
-	if (fd < 0) {
-		perror(argv[1]);
-		return 1;
+	if (fstat(img->fd, &img->info) < 0) {
+		perror(path);
+		goto fail;
 	}
+	TRACE("open");
 
-	if (fstat(fd, &info) < 0) {
-		perror(argv[1]);
-		return 1;
+	if (img->info.st_size < sizeof(*aout)) {
+		fprintf(stderr, "%s: too small to read a.out header\n", path);
+		goto fail;
 	}
 
-	if (info.st_size < sizeof(*aout)) {
-		fprintf(stderr, "%s: too small to read a.out header\n", argv[1]);
-		return 1;
+	/* Read a copy of the a.out header. */
+	if (pread(img->fd, raw, sizeof(raw), 0) != sizeof(raw)) {
+		perror(path);
+		goto fail;
 	}
 
-	aout = disk_image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (aout == MAP_FAILED) {
-		perror("mmap");
-		return 1;
+	img->format = aout_format(raw, aout);
+	if (!img->format) {
+		fprintf(stderr, "%s: not an a.out binary (header 0x%02x%02x%02x%02x)\n",
+			path, raw[0], raw[1], raw[2], raw[3]);
+		goto fail;
 	}
+	if (!img->format->runnable) {
+		fprintf(stderr, "%s: %s %s a.out binary can't be run here\n",
+			path, img->format->machine, img->format->name);
+		goto fail;
+	}
+	img->load_addr = img->format->load_addr;
+	img->txtoff = img->format->txtoff;
+	img->file_type = img->format->name;
+	img->data_off = aout_data_offset(img->format, aout);
 
-	/* Make a copy of the a.out header. */
-	aout_local = *aout;
-	aout = &aout_local;
+	if (aout->a_trsize % sizeof(struct relocation_info) ||
+	    aout->a_drsize % sizeof(struct relocation_info)) {
+		fprintf(stderr, "%s: a.out relocation tables must hold whole entries.\n", path);
+		goto fail;
+	}
 
-	switch (aout->a_info) {
-	case Q_MAGIC_MAGIC:
-		load_addr = Q_MAGIC_LOAD_ADDR;
-		txtoff = Q_MAGIC_TXT_FDOFF;
-		file_type = "QMAGIC";
-		break;
-	case Z_MAGIC_MAGIC:
-		load_addr = Z_MAGIC_LOAD_ADDR;
-		txtoff = Z_MAGIC_TXT_FDOFF;
-		file_type = "ZMAGIC";
-		break;
-	default:
-		fprintf(stderr, "%s: not ia32 QMAGIC or ZMAGIC a.out binary (header 0x%x != 0x%lx or 0x%lx)\n",
-			argv[1], aout->a_info, Q_MAGIC_MAGIC, Z_MAGIC_MAGIC);
-		return 1;
+	if (aout->a_syms % sizeof(struct nlist)) {
+		fprintf(stderr, "%s: a.out symbol table must hold whole entries.\n", path);
+		goto fail;
 	}
 
-	pagesize = getpagesize();
+	/* Text and data are followed by the relocations, then symbols. */
+	if ((uint64_t)img->txtoff + aout->a_text + aout->a_data +
+	    aout->a_trsize + aout->a_drsize + aout->a_syms > img->info.st_size) {
+		fprintf(stderr, "%s: a.out file is shorter than its header says.\n", path);
+		goto fail;
+	}
+
+	TRACE("header");
+	img->path = strdup(path);
+	if (!img->path) {
+		perror("strdup");
+		goto fail;
+	}
+	return 0;
 
-	/* How many bytes do we want from disk? */
-	image_bytes = info.st_size - txtoff;
+fail:
+	close_image(img);
+	return -1;
+}
 
-	/* Create region to hold final executable image. */
-	image = mmap((void *)load_addr, image_bytes,
-		     PROT_EXEC | PROT_READ | PROT_WRITE,
-		     MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (image == MAP_FAILED) {
-		perror("mmap");
-		check_mmap_min_addr(load_addr, file_type);
-		return 1;
+/*
+ * A relocatable binary linked below mmap_min_addr can be moved up past
+ * it instead of failing to map.
+ */
+static unsigned long load_bias(const struct aout_image *img)
+{
+	unsigned long min_addr = mmap_min_addr();
+
+	if (img->load_addr >= min_addr || !image_is_relocatable(img))
+		return 0;
+	return ALIGN(min_addr, pagesize) - img->load_addr;
+}
+
+/*
+ * Slide one segment by the image's bias, touching each relocation
+ * entry once. Fields pointing into the image move with it, unless
+ * they are pc-relative; pc-relative references to absolute symbols
+ * move the other way.
+ */
+static int relocate_segment(struct aout_image *img, unsigned char *seg,
+			    unsigned int seg_size,
+			    const struct relocation_info *rel, unsigned int count,
+			    const struct nlist *syms, unsigned int nr_syms)
+{
+	unsigned int type;
+	uint32_t word;
+
+	for (; count--; rel++) {
+		if (rel->r_length != 2 || seg_size < sizeof(word) ||
+		    (unsigned int)rel->r_address > seg_size - sizeof(word)) {
+			fprintf(stderr, "%s: unsupported relocation at 0x%x\n",
+				img->path, rel->r_address);
+			return -1;
+		}
+
+		if (rel->r_extern) {
+			if (rel->r_symbolnum >= nr_syms) {
+				fprintf(stderr, "%s: relocation at 0x%x uses missing symbol %u\n",
+					img->path, rel->r_address, rel->r_symbolnum);
+				return -1;
+			}
+			type = syms[rel->r_symbolnum].n_type & N_TYPE;
+			if (type == N_UNDF) {
+				fprintf(stderr, "%s: relocation at 0x%x uses undefined symbol %u\n",
+					img->path, rel->r_address, rel->r_symbolnum);
+				return -1;
+			}
+		} else {
+			type = rel->r_symbolnum & N_TYPE;
+		}
+
+		/* The field may not be aligned. */
+		memcpy(&word, seg + rel->r_address, sizeof(word));
+		if (!rel->r_pcrel && type != N_ABS)
+			word += img->bias;
+		else if (rel->r_pcrel && type == N_ABS)
+			word -= img->bias;
+		memcpy(seg + rel->r_address, &word, sizeof(word));
 	}
-	memcpy(image, disk_image + txtoff, image_bytes);
-	if (munmap(disk_image, info.st_size) < 0) {
-		perror("munmap");
-		return 1;
+
+	return 0;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+	const struct aout_symbol *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/*
+ * Copy the text, data and bss symbols into a sorted array, before
+ * .bss is laid over the file's symbol and string tables.
+ */
+static void index_symbols(struct aout_image *img, const struct nlist *syms,
+			  unsigned int nr_syms, const char *strs,
+			  size_t strs_avail)
+{
+	unsigned int i, type, count = 0;
+	uint32_t strs_size = 0;
+	size_t bytes = 0, len;
+	char *names;
+
+	if (strs_avail >= sizeof(strs_size))
+		memcpy(&strs_size, strs, sizeof(strs_size));
+	if (strs_size > strs_avail)
+		strs_size = strs_avail;
+
+	for (i = 0; i < nr_syms; i++) {
+		type = syms[i].n_type & N_TYPE;
+		if ((syms[i].n_type & N_STAB) ||
+		    (type != N_TEXT && type != N_DATA && type != N_BSS) ||
+		    syms[i].n_strx < sizeof(strs_size) ||
+		    syms[i].n_strx >= strs_size)
+			continue;
+		count++;
+		bytes += strnlen(strs + syms[i].n_strx,
+				 strs_size - syms[i].n_strx) + 1;
+	}
+	if (!count)
+		return;
+
+	bytes += count * sizeof(*symbols);
+	symbols = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (symbols == MAP_FAILED) {
+		symbols = NULL;
+		return;
 	}
+	names = (char *)(symbols + count);
+
+	for (i = 0; i < nr_syms; i++) {
+		type = syms[i].n_type & N_TYPE;
+		if ((syms[i].n_type & N_STAB) ||
+		    (type != N_TEXT && type != N_DATA && type != N_BSS) ||
+		    syms[i].n_strx < sizeof(strs_size) ||
+		    syms[i].n_strx >= strs_size)
+			continue;
+		len = strnlen(strs + syms[i].n_strx, strs_size - syms[i].n_strx);
+		memcpy(names, strs + syms[i].n_strx, len);
+		names[len] = '\0';
+		symbols[nr_symbols].addr = syms[i].n_value + img->bias;
+		symbols[nr_symbols].name = names;
+		nr_symbols++;
+		names += len + 1;
+	}
+	qsort(symbols, nr_symbols, sizeof(*symbols), compare_symbols);
+}
+
+/* Map text, data and bss at the load address. Closes the image's fd. */
+static int map_image(struct aout_image *img)
+{
+	struct a_out *aout = &img->aout;
+	unsigned char *image, *image_end, *bss, *bss_page, *bss_end, *text_end;
+	const struct relocation_info *trel, *drel;
+	const struct nlist *syms;
+	unsigned int nr_syms;
+	const char *strs;
+	size_t image_bytes;
+
+	/* How much room does everything from text onwards need? */
+	image_bytes = img->data_off + img->info.st_size - img->txtoff -
+		      aout->a_text;
+
+	img->bias = load_bias(img);
+
+	/*
+	 * Start reading everything from text onwards now, as one
+	 * sequential stream, rather than a page at a time as faults (or
+	 * the copy below) reach it. On a cold cache this is most of the
+	 * cost of starting a large binary.
+	 */
+	readahead(img->fd, img->txtoff, img->info.st_size - img->txtoff);
+
+	if (image_is_aligned(img)) {
+		/*
+		 * Page-aligned layout (QMAGIC): map the image straight from
+		 * the file, so pages are faulted in on demand and clean ones
+		 * are shared with every other instance of the same binary.
+		 */
+		image = mmap((void *)(img->load_addr + img->bias), image_bytes,
+			     PROT_READ | PROT_WRITE,
+			     MAP_FIXED | MAP_PRIVATE | populate_flags,
+			     img->fd, img->txtoff);
+		if (image == MAP_FAILED) {
+			perror("mmap");
+			check_mmap_min_addr(img->load_addr, img->file_type);
+			return -1;
+		}
+	} else {
+		/*
+		 * ZMAGIC text starts 1KiB into the file, and NMAGIC/OMAGIC
+		 * text 32 bytes in, so they cannot be mapped at a page
+		 * boundary: copy text, then data, into place instead.
+		 */
+		image = mmap((void *)(img->load_addr + img->bias), image_bytes,
+			     PROT_READ | PROT_WRITE,
+			     MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (image == MAP_FAILED) {
+			perror("mmap");
+			check_mmap_min_addr(img->load_addr, img->file_type);
+			return -1;
+		}
+		/* Before the copy faults it in with small pages. */
+		advise_hugepages(image, image + image_bytes);
+
+		/* --batch maps the file once, up front. */
+		if (!img->disk_image) {
+			img->disk_image = mmap(NULL, img->info.st_size, PROT_READ,
+					       MAP_PRIVATE | populate_flags,
+					       img->fd, 0);
+			if (img->disk_image == MAP_FAILED) {
+				img->disk_image = NULL;
+				perror("mmap");
+				return -1;
+			}
+		}
+		memcpy(image, img->disk_image + img->txtoff, aout->a_text);
+		memcpy(image + img->data_off,
+		       img->disk_image + img->txtoff + aout->a_text,
+		       image_bytes - img->data_off);
+	}
+	/* The mappings keep the file alive; don't leak it to the binary. */
+	close_image(img);
+	TRACE("image");
 
 	image_end = ALIGN(image + image_bytes, pagesize);
 
-	if (aout->a_syms != 0) {
-		fprintf(stderr, "%s: a.out header a_syms must be 0.\n", argv[1]);
-		return 1;
+	/* The tables follow data in the image, until .bss covers them. */
+	trel = (void *)(image + img->data_off + aout->a_data);
+	drel = (void *)((unsigned char *)trel + aout->a_trsize);
+	syms = (void *)((unsigned char *)drel + aout->a_drsize);
+	nr_syms = aout->a_syms / sizeof(*syms);
+	strs = (const char *)syms + aout->a_syms;
+
+	if (img->bias &&
+	    (relocate_segment(img, image, aout->a_text, trel,
+			      aout->a_trsize / sizeof(*trel), syms, nr_syms) < 0 ||
+	     relocate_segment(img, image + img->data_off, aout->a_data, drel,
+			      aout->a_drsize / sizeof(*drel), syms, nr_syms) < 0))
+		return -1;
+
+	if (index_syms && nr_syms) {
+		index_symbols(img, syms, nr_syms, strs,
+			      image + image_bytes - (unsigned char *)strs);
+		symbols_start = (unsigned long)image;
+		symbols_end = (unsigned long)image + img->data_off +
+			      aout->a_data + aout->a_bss;
 	}
+	TRACE("reloc");
 
-	if (aout->a_trsize != 0) {
-		fprintf(stderr, "%s: a.out header a_trsize must be 0.\n", argv[1]);
-		return 1;
+	/*
+	 * Only the page where data ends and .bss starts holds file
+	 * contents that must be cleared. Every whole page of .bss is
+	 * mapped anonymous instead (replacing any file pages there), so
+	 * it is zero-filled by the kernel only when first touched.
+	 */
+	bss = image + img->data_off + aout->a_data;
+	bss_page = ALIGN(bss, pagesize);
+	bss_end = ALIGN(bss + aout->a_bss, pagesize);
+	if (bss < image_end && bss_page > bss)
+		memset(bss, 0, bss_page - bss);
+	if (bss_end > bss_page &&
+	    mmap(bss_page, bss_end - bss_page, PROT_READ | PROT_WRITE,
+		 MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0) == MAP_FAILED) {
+		perror("mmap bss");
+		return -1;
 	}
+	advise_hugepages(bss_page, bss_end);
+	TRACE("bss");
 
-	if (aout->a_drsize != 0) {
-		fprintf(stderr, "%s: a.out header a_drsize must be 0.\n", argv[1]);
-		return 1;
+	/*
+	 * Now that everything is written, make text read+exec, leaving
+	 * data and bss read+write. If text ends mid-page, that page is
+	 * shared with data and has to stay writable and executable.
+	 */
+	text_end = ALIGN_DOWN(image + aout->a_text, pagesize);
+	/* OMAGIC ("impure") text is writable by definition. */
+	if (img->format->magic == OMAGIC)
+		text_end = image;
+	if (text_end > image &&
+	    mprotect(image, text_end - image, PROT_READ | PROT_EXEC) < 0) {
+		perror("mprotect text");
+		return -1;
+	}
+	if (img->format->magic != OMAGIC && text_end != image + aout->a_text &&
+	    mprotect(text_end, pagesize,
+		     PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+		perror("mprotect text");
+		return -1;
 	}
+	TRACE("protect");
 
-	/* See if .bss needs to extend beyond end of the file mmap. */
-	bss = image + aout->a_text + aout->a_data;
-	bss_end = bss + aout->a_bss;
-	if (bss_end > image_end) {
-		bss = mmap(bss, aout->a_bss, PROT_READ | PROT_WRITE,
-			   MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-		if (bss == MAP_FAILED) {
-			perror("mmap bss");
-			return 1;
-		}
+	return 0;
+}
+
+static const struct aout_symbol *lookup_symbol(unsigned long addr)
+{
+	unsigned int lo = 0, hi = nr_symbols, mid;
+
+	if (addr < symbols_start || addr >= symbols_end)
+		return NULL;
+
+	/* Find the last symbol at or below addr. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	/* Zero out .bss. */
-	memset(bss, 0, ALIGN(aout->a_bss, pagesize));
+	return lo ? &symbols[lo - 1] : NULL;
+}
+
+/* Formatting for the crash handler, which can only use write(2). */
+static void crash_puts(char *buf, size_t *len, size_t size, const char *str)
+{
+	while (*str && *len < size)
+		buf[(*len)++] = *str++;
+}
+
+static void crash_hex(char *buf, size_t *len, size_t size, unsigned long val)
+{
+	char digits[2 + 2 * sizeof(val) + 1];
+	int i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+	do {
+		digits[--i] = "0123456789abcdef"[val & 0xf];
+		val >>= 4;
+	} while (val);
+	digits[--i] = 'x';
+	digits[--i] = '0';
+	crash_puts(buf, len, size, digits + i);
+}
+
+static void crash_dec(char *buf, size_t *len, size_t size, unsigned int val)
+{
+	char digits[sizeof(val) * 3 + 1];
+	int i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+	do {
+		digits[--i] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	crash_puts(buf, len, size, digits + i);
+}
+
+static void crash_handler(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+#ifdef __i386__
+	unsigned long pc = uc->uc_mcontext.gregs[REG_EIP];
+#else
+	unsigned long pc = uc->uc_mcontext.gregs[REG_RIP];
+#endif
+	const struct aout_symbol *sym = lookup_symbol(pc);
+	char buf[256];
+	size_t len = 0;
+
+	crash_puts(buf, &len, sizeof(buf), "aout: signal ");
+	crash_dec(buf, &len, sizeof(buf), sig);
+	crash_puts(buf, &len, sizeof(buf), " at ");
+	crash_hex(buf, &len, sizeof(buf), pc);
+	if (sym) {
+		crash_puts(buf, &len, sizeof(buf), " <");
+		crash_puts(buf, &len, sizeof(buf), sym->name);
+		crash_puts(buf, &len, sizeof(buf), "+");
+		crash_hex(buf, &len, sizeof(buf), pc - sym->addr);
+		crash_puts(buf, &len, sizeof(buf), ">");
+	}
+	crash_puts(buf, &len, sizeof(buf), "\n");
+	if (write(STDERR_FILENO, buf, len) < 0) {
+		/* Nowhere else to say it; die all the same. */
+	}
+	/*
+	 * SA_RESETHAND has put the default action back. Returning would
+	 * only retry a real fault, not one sent with kill(), so re-raise.
+	 */
+	raise(sig);
+}
+
+/* Report crashes of the binary by name, unless it installs its own. */
+static void install_crash_handler(void)
+{
+	static const int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE };
+	struct sigaction sa = {
+		.sa_sigaction = crash_handler,
+		.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND,
+	};
+	stack_t ss = { .ss_size = 64 * 1024 };
+	unsigned int i;
+
+	/* The binary's own stack may be what went wrong. */
+	ss.ss_sp = mmap(NULL, ss.ss_size, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ss.ss_sp == MAP_FAILED || sigaltstack(&ss, NULL) < 0)
+		return;
+
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < sizeof(signals) / sizeof(*signals); i++)
+		sigaction(signals[i], &sa, NULL);
+}
+
+/* Size the new stack like the current one. */
+static int read_stack_limit(void)
+{
+	struct rlimit rlim;
 
-	/* Prepare stack, based on current stack. */
 	if (getrlimit(RLIMIT_STACK, &rlim) < 0) {
 		perror("getrlimit");
-		return 1;
+		return -1;
 	}
 
 	/* Default to 8MiB */
 	if (rlim.rlim_cur == RLIM_INFINITY)
 		rlim.rlim_cur = 8 * 1024 * 1024;
 
-	stack = mmap(NULL, rlim.rlim_cur, PROT_EXEC | PROT_READ | PROT_WRITE,
-			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	stack_size = rlim.rlim_cur;
+	return 0;
+}
+
+/*
+ * Host auxv entries handed on unchanged, when the host has them. The
+ * vDSO stays mapped across the jump, so AT_SYSINFO (__kernel_vsyscall)
+ * and AT_SYSINFO_EHDR remain valid for the binary, and a libc that
+ * looks for them can avoid "int $0x80".
+ */
+static const unsigned long host_auxv_types[] = {
+	AT_SYSINFO,
+	AT_SYSINFO_EHDR,
+	AT_HWCAP,
+	AT_HWCAP2,
+	AT_PLATFORM,
+	AT_CLKTCK,
+#ifdef AT_MINSIGSTKSZ
+	AT_MINSIGSTKSZ,
+#endif
+	AT_UID,
+	AT_EUID,
+	AT_GID,
+	AT_EGID,
+	AT_SECURE,
+};
+
+#define AUXV_RANDOM_BYTES	16
+/* The loader's own entries, the host's, and AT_NULL; as type/value pairs. */
+#define AUXV_MAX_WORDS		(2 * (4 + ARRAY_SIZE(host_auxv_types) + 1))
+
+#define AUXV_ENTRY(auxv, n, type, val)	do {			\
+	(auxv)[(n)++] = (type);					\
+	(auxv)[(n)++] = (unsigned long)(val);			\
+} while (0)
+
+/*
+ * Fill in an ELF-style auxiliary vector for the binary, which goes
+ * right after the envp terminator on its stack. Returns the number of
+ * words used.
+ */
+static unsigned int build_auxv(unsigned long *auxv,
+			       const struct aout_image *img,
+			       const char *execfn, const void *random)
+{
+	unsigned int i, n = 0;
+	unsigned long val;
+
+	AUXV_ENTRY(auxv, n, AT_PAGESZ, pagesize);
+	AUXV_ENTRY(auxv, n, AT_ENTRY, img->aout.a_entry + img->bias);
+	AUXV_ENTRY(auxv, n, AT_RANDOM, random);
+	AUXV_ENTRY(auxv, n, AT_EXECFN, execfn);
+
+	for (i = 0; i < ARRAY_SIZE(host_auxv_types); i++) {
+		/* Zero is a valid value for most of these (AT_UID...). */
+		errno = 0;
+		val = getauxval(host_auxv_types[i]);
+		if (val || errno != ENOENT)
+			AUXV_ENTRY(auxv, n, host_auxv_types[i], val);
+	}
+
+	AUXV_ENTRY(auxv, n, AT_NULL, 0);
+	return n;
+}
+
+/* Fresh AT_RANDOM bytes, so --batch children don't all share them. */
+static void fill_random(void *buf, size_t len)
+{
+	const void *host;
+
+	if (getrandom(buf, len, GRND_NONBLOCK) == len)
+		return;
+	host = (const void *)getauxval(AT_RANDOM);
+	if (host)
+		memcpy(buf, host, len);
+}
+
+/*
+ * Map the image, build its stack from argv (argv[0] being the a.out
+ * path) and envp, and jump to its entry point. Only returns on failure.
+ */
+static int exec_image(struct aout_image *img, int argc, char *argv[],
+		      char *envp[])
+{
+	unsigned long auxv[AUXV_MAX_WORDS];
+	unsigned int auxv_words;
+	unsigned char *stack, *stack_end;
+	char **p;
+	unsigned long *sp;
+	int argc_copy, envc_copy;
+	char **argv_copy, **envp_copy;
+
+	if (map_image(img) < 0)
+		return -1;
+
+	/*
+	 * Reserve the whole rlimit, but without charging it against
+	 * overcommit: only the pages the binary touches get allocated.
+	 */
+	stack = mmap(NULL, stack_size, stack_prot,
+		     MAP_ANONYMOUS | MAP_PRIVATE | MAP_GROWSDOWN | MAP_NORESERVE,
+		     -1, 0);
 	if (stack == MAP_FAILED) {
 		perror("mmap stack");
-		return 1;
+		return -1;
 	}
-	stack_end = ALIGN(stack + rlim.rlim_cur, pagesize);
+	stack_end = ALIGN(stack + stack_size, pagesize);
+	TRACE("stack");
 
-	/* Fill top of stack with arg/env pointers. */
+	/* Top of stack: AT_RANDOM bytes, then the auxv below them. */
 	sp = (unsigned long *)stack_end;
-	sp--;
+	sp -= AUXV_RANDOM_BYTES / sizeof(*sp);
+	fill_random(sp, AUXV_RANDOM_BYTES);
+	auxv_words = build_auxv(auxv, img, argv[0], sp);
+	sp -= auxv_words;
+	memcpy(sp, auxv, auxv_words * sizeof(*sp));
 
-	/* do not include argv[0] */
-	argc_copy = argc - 1;
-	argv++;
+	/* Below that, the arg/env pointers. */
+
+	argc_copy = argc;
 
 	/* count envp */
 	for (envc_copy = 0, p = envp; *p; envc_copy++, p++) ;
@@ -242,11 +876,397 @@ int main(int argc, char *argv[], char *envp[])
 	/* copy envp (contents can stay where they already are) */
 	while (envc_copy--)
 		*envp_copy++ = *envp++;
+	*envp_copy = 0;
+
+	TRACE("args");
+
+	if (nr_symbols) {
+		install_crash_handler();
+		TRACE("signals");
+	}
+
+	if (trace_fd >= 0)
+		trace_emit(img->path);
 
 	/* Aim sp at argc, and jump! */
-	asm volatile ("movl %0, %%esp\njmp *%1\n" : : "rm" (sp), "r"(aout->a_entry));
+	asm volatile ("movl %0, %%esp\njmp *%1\n" : : "rm" (sp), "r"(img->aout.a_entry + img->bias));
 
 	/* This should be unreachable. */
 	fprintf(stderr, "They found me. I don't how, but they found me.\n");
-	return 2;
+	exit(2);
+}
+
+/* Validated images for --batch, kept open (and mapped, if copied). */
+static struct aout_image *image_cache;
+
+static struct aout_image *cached_image(const char *path)
+{
+	struct aout_image *img, **pp;
+	struct stat info;
+
+	if (stat(path, &info) < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	for (pp = &image_cache; (img = *pp); pp = &img->next) {
+		if (strcmp(img->path, path))
+			continue;
+		if (img->info.st_dev == info.st_dev &&
+		    img->info.st_ino == info.st_ino &&
+		    img->info.st_size == info.st_size &&
+		    img->info.st_mtim.tv_sec == info.st_mtim.tv_sec &&
+		    img->info.st_mtim.tv_nsec == info.st_mtim.tv_nsec)
+			return img;
+		/* Replaced or rewritten since it was cached. */
+		*pp = img->next;
+		close_image(img);
+		free(img->path);
+		free(img);
+		break;
+	}
+
+	img = calloc(1, sizeof(*img));
+	if (!img) {
+		perror("calloc");
+		return NULL;
+	}
+	if (open_image(img, path) < 0) {
+		free(img);
+		return NULL;
+	}
+	/* Fail here once, rather than in every child. */
+	if (mmap_min_addr() > img->load_addr && !image_is_relocatable(img)) {
+		fprintf(stderr, "%s: cannot be mapped at %lu\n", path,
+			img->load_addr);
+		check_mmap_min_addr(img->load_addr, img->file_type);
+		close_image(img);
+		free(img->path);
+		free(img);
+		return NULL;
+	}
+	if (!image_is_aligned(img)) {
+		img->disk_image = mmap(NULL, img->info.st_size, PROT_READ,
+				       MAP_PRIVATE | populate_flags, img->fd, 0);
+		/* map_image() will try again in the child. */
+		if (img->disk_image == MAP_FAILED)
+			img->disk_image = NULL;
+	}
+
+	img->next = image_cache;
+	image_cache = img;
+	return img;
+}
+
+/* Split a job line into its argv, and look up (or load) its image. */
+static int parse_job(char *line, struct aout_job *job)
+{
+	char *arg, *save;
+
+	line[strcspn(line, "\n")] = '\0';
+	line += strspn(line, " \t");
+	/* Skip blank lines and comments. */
+	if (!*line || *line == '#')
+		return 1;
+
+	job->argv = calloc(strlen(line) / 2 + 2, sizeof(*job->argv));
+	if (!job->argv) {
+		perror("calloc");
+		return -1;
+	}
+	job->argc = 0;
+	for (arg = strtok_r(line, " \t", &save); arg;
+	     arg = strtok_r(NULL, " \t", &save))
+		job->argv[job->argc++] = arg;
+
+	job->image = cached_image(job->argv[0]);
+	if (!job->image) {
+		free(job->argv);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fork a child for the job and wait for it. "job_fd" is where the job
+ * came from, which the child must not inherit. Returns the wait status.
+ */
+static int run_job(struct aout_job *job, char *envp[], int job_fd)
+{
+	struct aout_image *img;
+	int status, null;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		/* Time this job from its fork. */
+		trace_init();
+		if (job_fd == STDIN_FILENO) {
+			null = open("/dev/null", O_RDONLY);
+			if (null >= 0 && null != STDIN_FILENO) {
+				dup2(null, STDIN_FILENO);
+				close(null);
+			}
+		} else if (job_fd >= 0) {
+			close(job_fd);
+		}
+		for (img = image_cache; img; img = img->next) {
+			if (img == job->image)
+				continue;
+			close_image(img);
+		}
+		exec_image(job->image, job->argc, job->argv, envp);
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			return -1;
+		}
+	}
+	return status;
+}
+
+/*
+ * Read one line, up to a newline or EOF, from a socket. Fails with
+ * ETIMEDOUT if the whole line takes more than "timeout" ms to arrive.
+ */
+static ssize_t read_line(int fd, char *buf, size_t size, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct timespec start, now;
+	size_t len = 0;
+	ssize_t ret;
+	long waited;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (len < size - 1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		waited = (now.tv_sec - start.tv_sec) * 1000 +
+			 (now.tv_nsec - start.tv_nsec) / 1000000;
+		ret = waited < timeout ? poll(&pfd, 1, timeout - waited) : 0;
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (ret > 0)
+			ret = read(fd, buf + len, size - 1 - len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+		if (memchr(buf + len - ret, '\n', ret))
+			break;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Accept one job line per connection on a Unix socket, and answer with
+ * "exit N", "signal N" or "error" once the job has finished. Images are
+ * cached here, in the server; each job gets its own handler process so
+ * jobs can run concurrently. A client gets BATCH_LINE_TIMEOUT_MS to send
+ * its line, which is as long as it can hold up the others.
+ */
+static int serve_jobs(const char *path, char *envp[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct aout_job job;
+	char line[4096];
+	int sock, conn, status;
+	pid_t pid;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, SOMAXCONN) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	/* Handlers report back over their connection; nobody waits. */
+	signal(SIGCHLD, SIG_IGN);
+	/* Look these up once, not in every handler. */
+	mmap_min_addr();
+	hugepage_size();
+
+	for (;;) {
+		conn = accept(sock, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return 1;
+		}
+
+		if (read_line(conn, line, sizeof(line),
+			      BATCH_LINE_TIMEOUT_MS) < 0 ||
+		    parse_job(line, &job) != 0) {
+			dprintf(conn, "error\n");
+			close(conn);
+			continue;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			dprintf(conn, "error\n");
+		}
+		if (pid == 0) {
+			signal(SIGCHLD, SIG_DFL);
+			close(sock);
+			status = run_job(&job, envp, conn);
+			if (status < 0)
+				dprintf(conn, "error\n");
+			else if (WIFSIGNALED(status))
+				dprintf(conn, "signal %d\n", WTERMSIG(status));
+			else
+				dprintf(conn, "exit %d\n", WEXITSTATUS(status));
+			_exit(0);
+		}
+		close(conn);
+		free(job.argv);
+	}
+}
+
+/* Run each job in turn; returns non-zero if any of them failed. */
+static int run_batch(const char *jobs, char *envp[])
+{
+	struct aout_job job;
+	char *line = NULL;
+	size_t size = 0;
+	int status, ret, failed = 0;
+	FILE *list;
+
+	if (!strncmp(jobs, "unix:", 5))
+		return serve_jobs(jobs + 5, envp);
+
+	list = strcmp(jobs, "-") ? fopen(jobs, "r") : stdin;
+	if (!list) {
+		perror(jobs);
+		return 1;
+	}
+
+	while (getline(&line, &size, list) > 0) {
+		ret = parse_job(line, &job);
+		if (ret > 0)
+			continue;
+		if (ret < 0) {
+			failed++;
+			continue;
+		}
+
+		status = run_job(&job, envp, fileno(list));
+		if (status < 0)
+			failed++;
+		else if (WIFSIGNALED(status)) {
+			fprintf(stderr, "%s: killed by signal %d\n",
+				job.argv[0], WTERMSIG(status));
+			failed++;
+		} else if (WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: exited with status %d\n",
+				job.argv[0], WEXITSTATUS(status));
+			failed++;
+		}
+		free(job.argv);
+	}
+
+	free(line);
+	if (list != stdin)
+		fclose(list);
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[], char *envp[])
+{
+	struct aout_image img;
+	const char *prog = argv[0];
+	const char *batch = NULL;
+	static const struct option long_options[] = {
+		{ "batch",	required_argument,	NULL, 'b' },
+		{ "exec-stack",	no_argument,		NULL, 'x' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "populate",	no_argument,		NULL, 'p' },
+		{ "symbols",	no_argument,		NULL, 's' },
+		{ }
+	};
+	int opt;
+
+	trace_init();
+
+	if (sizeof(void *) != 4) {
+		fprintf(stderr, "Eek: I was compiled in 64-bit mode. Please build with -m32.\n");
+		return 1;
+	}
+
+	/* Stop at the a.out path: everything after it belongs to the binary. */
+	while ((opt = getopt_long(argc, argv, "+b:hpsx", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			batch = optarg;
+			break;
+		case 'p':
+			populate_flags = MAP_POPULATE;
+			break;
+		case 's':
+			index_syms = 1;
+			break;
+		case 'x':
+			stack_prot |= PROT_EXEC;
+			break;
+		case 'h':
+			usage(prog);
+			return 0;
+		default:
+			usage(prog);
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	pagesize = getpagesize();
+
+	/* Prepare stack, based on current stack. */
+	if (read_stack_limit() < 0)
+		return 1;
+
+	if (batch) {
+		if (argc) {
+			usage(prog);
+			return 1;
+		}
+		return run_batch(batch, envp);
+	}
+
+	if (argc < 1) {
+		usage(prog);
+		return 1;
+	}
+
+	if (open_image(&img, argv[0]) < 0)
+		return 1;
+
+	exec_image(&img, argc, argv, envp);
+	return 1;
 }
@@ -0,0 +1,172 @@
+/*
+ * a.out header layout and the registry of a.out variants, shared by
+ * the aout loader and anything else that needs to classify binaries.
+ * License: GPLv2
+ *
+ * Locally define the stuff from a.out.h since that file may disappear.
+ */
+#ifndef __AOUT_H
+#define __AOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct a_out
+{
+	unsigned int a_info;	/* machine type, magic, etc */
+	unsigned int a_text;	/* text size */
+	unsigned int a_data;	/* data size */
+	unsigned int a_bss;	/* desired bss size */
+	unsigned int a_syms;	/* symbol table size */
+	unsigned int a_entry;	/* entry address */
+	unsigned int a_trsize;	/* text relocation size */
+	unsigned int a_drsize;	/* data relocation size */
+};
+
+/* Text and data relocations, as kept by "ld -q". */
+struct relocation_info
+{
+	int r_address;			/* offset into the segment */
+	unsigned int r_symbolnum:24;	/* symbol index, or segment type */
+	unsigned int r_pcrel:1;		/* relative to the program counter */
+	unsigned int r_length:2;	/* log2 of the size of the field */
+	unsigned int r_extern:1;	/* r_symbolnum is a symbol index */
+	unsigned int r_pad:4;
+};
+
+struct nlist
+{
+	int n_strx;		/* offset of the name in the string table */
+	unsigned char n_type;
+	char n_other;
+	short n_desc;
+	unsigned int n_value;
+};
+
+#define N_UNDF			0x00
+#define N_ABS			0x02
+#define N_TEXT			0x04
+#define N_DATA			0x06
+#define N_BSS			0x08
+#define N_TYPE			0x1e
+#define N_STAB			0xe0
+
+#define MMAP_MIN_ADDR_PATH	"/proc/sys/vm/mmap_min_addr"
+
+/*
+ * vm.mmap_min_addr, or 0 if it can't be read. Read once; a threaded
+ * caller must make the first call before starting its threads.
+ */
+static inline unsigned long mmap_min_addr(void)
+{
+	static unsigned long addr;
+	static int cached;
+	char buf[128];
+	FILE *proc;
+
+	if (cached)
+		return addr;
+	cached = 1;
+
+	proc = fopen(MMAP_MIN_ADDR_PATH, "r");
+	if (!proc)
+		return addr;
+	if (fgets(buf, sizeof(buf), proc))
+		addr = strtoul(buf, NULL, 0);
+	fclose(proc);
+	return addr;
+}
+
+/* a_info holds flags in its top byte, then the machine, then the magic. */
+#define N_MAGIC(info)		((info) & 0xffff)
+#define N_MACHTYPE(info)	(((info) >> 16) & 0xff)
+
+#define OMAGIC			0407	/* impure: text and data contiguous */
+#define NMAGIC			0410	/* pure: read-only text */
+#define ZMAGIC			0413	/* demand paged */
+#define QMAGIC			0314	/* demand paged, header in text page */
+
+#define M_68010			1
+#define M_68020			2
+#define M_SPARC			3
+#define M_386			100
+
+/*
+ * Everything needed to find the segments of one a.out variant. Data is
+ * laid out in memory at the end of text rounded up to segment_size, and
+ * in the file straight after text. Only the ia32 variants can be run by
+ * the loader; the others are listed so binaries can be identified, and
+ * their layout values are the SunOS defaults.
+ */
+struct aout_format {
+	const char *name;
+	const char *machine;
+	unsigned int magic;
+	unsigned int machtype;
+	int big_endian;
+	unsigned int txtoff;		/* file offset of text */
+	unsigned long load_addr;	/* address of text */
+	unsigned int segment_size;	/* alignment of data in memory */
+	int runnable;
+};
+
+static const struct aout_format aout_formats[] = {
+	{ "QMAGIC", "ia32",   QMAGIC, M_386,   0, 0x0000, 0x1000, 0x400,  1 },
+	{ "ZMAGIC", "ia32",   ZMAGIC, M_386,   0, 0x0400, 0x0000, 0x400,  1 },
+	{ "NMAGIC", "ia32",   NMAGIC, M_386,   0, 0x0020, 0x0000, 0x400,  1 },
+	{ "OMAGIC", "ia32",   OMAGIC, M_386,   0, 0x0020, 0x0000, 1,      1 },
+	{ "ZMAGIC", "m68k",   ZMAGIC, M_68020, 1, 0x0000, 0x2000, 0x2000, 0 },
+	{ "NMAGIC", "m68k",   NMAGIC, M_68020, 1, 0x0020, 0x2000, 0x2000, 0 },
+	{ "OMAGIC", "m68k",   OMAGIC, M_68020, 1, 0x0020, 0x2000, 1,      0 },
+	{ "ZMAGIC", "m68010", ZMAGIC, M_68010, 1, 0x0000, 0x2000, 0x2000, 0 },
+	{ "NMAGIC", "m68010", NMAGIC, M_68010, 1, 0x0020, 0x2000, 0x2000, 0 },
+	{ "OMAGIC", "m68010", OMAGIC, M_68010, 1, 0x0020, 0x2000, 1,      0 },
+	{ "ZMAGIC", "sparc",  ZMAGIC, M_SPARC, 1, 0x0000, 0x2000, 0x2000, 0 },
+	{ "NMAGIC", "sparc",  NMAGIC, M_SPARC, 1, 0x0020, 0x2000, 0x2000, 0 },
+	{ "OMAGIC", "sparc",  OMAGIC, M_SPARC, 1, 0x0020, 0x2000, 1,      0 },
+};
+
+#define AOUT_NR_FORMATS		(sizeof(aout_formats) / sizeof(*aout_formats))
+
+static inline uint32_t aout_word(const unsigned char *p, int big_endian)
+{
+	if (big_endian)
+		return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	return (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/*
+ * Identify a header from its bytes on disk, and decode it into host
+ * byte order. Returns NULL for anything that isn't a known a.out.
+ */
+static inline const struct aout_format *
+aout_format(const unsigned char raw[sizeof(struct a_out)], struct a_out *aout)
+{
+	uint32_t info[2] = { aout_word(raw, 0), aout_word(raw, 1) };
+	const struct aout_format *fmt;
+	unsigned int i;
+
+	for (fmt = aout_formats; fmt < aout_formats + AOUT_NR_FORMATS; fmt++) {
+		if (N_MAGIC(info[fmt->big_endian]) != fmt->magic ||
+		    N_MACHTYPE(info[fmt->big_endian]) != fmt->machtype)
+			continue;
+		for (i = 0; i < sizeof(*aout) / sizeof(uint32_t); i++)
+			((unsigned int *)aout)[i] =
+				aout_word(raw + i * sizeof(uint32_t),
+					  fmt->big_endian);
+		return fmt;
+	}
+	return NULL;
+}
+
+/* Offset of data from the start of text, once loaded. */
+static inline unsigned int aout_data_offset(const struct aout_format *fmt,
+					    const struct a_out *aout)
+{
+	return (aout->a_text + fmt->segment_size - 1) &
+	       ~(fmt->segment_size - 1);
+}
+
+#endif /* __AOUT_H */
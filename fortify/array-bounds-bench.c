@@ -0,0 +1,125 @@
+/*
+ * Measure what -fsanitize=bounds and __counted_by cost on flexible
+ * array accesses, using the same structures and allocation helpers as
+ * the array-bounds tests. See Makefile: one binary is built for each
+ * combination of ARRAY_SANITIZER on/off, __counted_by on/off and
+ * -fstrict-flex-arrays level, and each prints one row per struct,
+ * length and access kind.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "array-bounds.h"
+
+#ifndef BENCH_CONFIG
+# define BENCH_CONFIG	"default"
+#endif
+
+/* Used to stop optimizer from seeing constant expressions. */
+volatile int unconst = 0;
+
+/* Keeps read loops from being optimized away. */
+volatile long sink;
+
+static const int lengths[] = { 8, 64, 120, 1024, 4096 };
+
+static void report(const char *name, int length, const char *op,
+		   const struct bench_result *r)
+{
+	printf("%-24s %-20s %6d  %-5s %10.3f %8.3f\n", BENCH_CONFIG, name,
+	       length, op, r->mean, r->ci95);
+}
+
+/*
+ * Walk p->array[0 .. count-1] writing, then reading, every element.
+ * The bound comes from the struct itself, the way a kernel loop over
+ * a counted flexible array would be written.
+ */
+#define BENCH_ARRAY(name, p, array, count, length) do {		\
+	struct bench_result r;						\
+	long sum;							\
+	int i;								\
+									\
+	BENCH_CYCLES(&r, length, {					\
+		for (i = 0; i < (p)->count; i++)			\
+			(p)->array[i] = i;				\
+		barrier_data(p);					\
+	});								\
+	report(name, length, "write", &r);				\
+	BENCH_CYCLES(&r, length, {					\
+		sum = 0;						\
+		for (i = 0; i < (p)->count; i++)			\
+			sum += (p)->array[i];				\
+		sink = sum;						\
+	});								\
+	report(name, length, "read", &r);				\
+} while (0)
+
+int main(void)
+{
+	unsigned int l;
+	int length;
+
+	printf("# array-bounds-bench: " __VERSION__ "\n");
+	printf("# %-22s %-20s %6s  %-5s %10s %8s\n", "config", "struct",
+	       "length", "op", BENCH_CYCLE_UNIT "/elem", "+-95%");
+
+	for (l = 0; l < sizeof(lengths) / sizeof(*lengths); l++) {
+		length = lengths[l] + unconst;
+
+		{
+			/* Unannotated baseline; alloc_flex() leaves count unset. */
+			struct flex *p = alloc_flex(length);
+
+			p->count = length;
+			BENCH_ARRAY("flex", p, array, count, length);
+			free(p);
+		}
+		{
+			struct annotated *p = alloc_annotated(length);
+
+			BENCH_ARRAY("annotated", p, array, count, length);
+			free(p);
+		}
+		{
+			struct anon_struct *p = alloc_anon_struct(length);
+
+			BENCH_ARRAY("anon_struct", p, array, count, length);
+			free(p);
+		}
+		{
+			struct composite *p = alloc_composite(length);
+
+			BENCH_ARRAY("composite", p, inner.array, inner.count,
+				    length);
+			free(p);
+		}
+		{
+			struct multi *p = alloc_multi_bytes(length);
+
+			BENCH_ARRAY("multi_bytes", p, bytes, count_bytes, length);
+			free(p);
+		}
+		/* count_ints is an s8. */
+		if (length <= INT8_MAX) {
+			struct multi *p = alloc_multi_ints(length);
+
+			BENCH_ARRAY("multi_ints", p, ints, count_ints, length);
+			free(p);
+		}
+#ifdef COUNTED_BY_POINTERS
+		/* count is an unsigned char. */
+		if (length <= UINT8_MAX) {
+			struct ptr_annotated *p = alloc_ptr_annotated(length);
+
+			BENCH_ARRAY("ptr_annotated", p, array, count, length);
+			free(p->array);
+			free(p);
+		}
+#endif
+	}
+
+	return 0;
+}
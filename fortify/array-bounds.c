@@ -5,11 +5,7 @@
 #include <malloc.h>
 
 #include "harness.h"
-
-typedef unsigned char u8;
-typedef signed char s8;
-
-#define noinline __attribute__((__noinline__))
+#include "array-bounds.h"
 
 /* Used to stop optimizer from seeing constant expressions. */
 volatile int unconst = 0;
@@ -38,31 +34,6 @@ volatile void *escape;
 	if (debug) fflush(NULL); \
 } while (0)
 
-#if __has_attribute(__counted_by__)
-# define __counted_by(member)	__attribute__((__counted_by__(member)))
-#else
-# define __counted_by(member)	/* __attribute__((__counted_by__(member))) */
-#endif
-
-#define DECLARE_FLEX_ARRAY(TYPE, NAME)		\
-	struct {				\
-		struct { } __empty_ ## NAME;	\
-		TYPE NAME[];			\
-	}
-
-#define DECLARE_BOUNDED_FLEX_ARRAY(COUNT_TYPE, COUNT, TYPE, NAME)	\
-	struct {							\
-		COUNT_TYPE COUNT;					\
-		TYPE NAME[] __counted_by(COUNT);			\
-	}
-
-#define DECLARE_FLEX_ARRAY_COUNTED_BY(TYPE, NAME, COUNTED_BY)		\
-	struct {							\
-		struct { } __empty_ ## NAME;				\
-		TYPE NAME[] __counted_by(COUNTED_BY);			\
-	}
-
-#define MAX_INDEX	16
 #define SIZE_BUMP	 2
 
 enum enforcement {
@@ -70,55 +41,6 @@ enum enforcement {
 	SHOULD_TRAP,
 };
 
-struct fixed {
-	unsigned long flags;
-	size_t count;
-	int array[MAX_INDEX];
-};
-
-struct flex {
-	unsigned long flags;
-	long count;
-	int array[];
-};
-
-struct annotated {
-	unsigned long flags;
-	long count;
-	int array[] __counted_by(count);
-};
-
-struct multi {
-	unsigned long flags;
-	union {
-		/* count member type intentionally mismatched to induce padding */
-		DECLARE_BOUNDED_FLEX_ARRAY(int, count_bytes, unsigned char, bytes);
-		DECLARE_BOUNDED_FLEX_ARRAY(s8,  count_ints,  unsigned char, ints);
-		DECLARE_FLEX_ARRAY(unsigned char, unsafe);
-	};
-};
-
-struct anon_struct {
-	unsigned long flags;
-	long count;
-	int array[] __counted_by(count);
-	//gcc: DECLARE_FLEX_ARRAY_COUNTED_BY(int, array, count);
-};
-
-struct composite {
-	unsigned stuff;
-	struct annotated inner;
-};
-
-/* Initial support in development. */
-#ifdef COUNTED_BY_POINTERS
-struct ptr_annotated {
-	unsigned long flags;
-	int *array __counted_by(count);
-	unsigned char count;
-};
-#endif
-
 /*
  * Test safe accesses at index 0 and index-1, then optionally check
  * what happens when accessing "index".
@@ -150,85 +72,6 @@ struct ptr_annotated {
 	}							\
 } while (0)
 
-/* Helper to hide the allocation size by using a leaf function. */
-static struct flex * noinline alloc_flex(int index)
-{
-	struct flex *f;
-
-	return malloc(sizeof(*f) + index * sizeof(*f->array));
-}
-
-/* Helper to hide the allocation size by using a leaf function. */
-static struct annotated * noinline alloc_annotated(int index)
-{
-	struct annotated *p;
-
-	p = malloc(sizeof(*p) + index * sizeof(*p->array));
-	p->count = index;
-
-	return p;
-}
-
-/* Helper to hide the allocation size by using a leaf function. */
-static struct multi * noinline alloc_multi_ints(int index)
-{
-	struct multi *p;
-
-	p = malloc(sizeof(*p) + index * sizeof(*p->ints));
-	p->count_ints = index;
-
-	return p;
-}
-
-/* Helper to hide the allocation size by using a leaf function. */
-static struct multi * noinline alloc_multi_bytes(int index)
-{
-	struct multi *p;
-
-	p = malloc(sizeof(*p) + index * sizeof(*p->bytes));
-	p->count_bytes = index;
-
-	return p;
-}
-
-/* Helper to hide the allocation size by using a leaf function. */
-static struct anon_struct * noinline alloc_anon_struct(int index)
-{
-	struct anon_struct *p;
-
-	p = malloc(sizeof(*p) + index * sizeof(*p->array));
-	p->count = index;
-
-	return p;
-}
-
-/* Helper to hide the allocation size by using a leaf function. */
-static struct composite * noinline alloc_composite(int index)
-{
-	struct composite *p;
-
-	p = malloc(sizeof(*p) + index * sizeof(*p->inner.array));
-	p->inner.count = index;
-
-	return p;
-}
-
-#ifdef COUNTED_BY_POINTERS
-static struct ptr_annotated * noinline alloc_ptr_annotated(int index)
-{
-	struct ptr_annotated *p;
-	void *a;
-
-	/* Explicitly allocate out of order just to see if anything breaks. */
-	a = malloc(index * sizeof(*p->array));
-	p = malloc(sizeof(*p));
-	p->array = a;
-	p->count = index;
-
-	return p;
-}
-#endif
-
 /*
  * For a structure ending with a fixed-size array, sizeof(*p) should
  * match __builtin_object_size(p, 1), which should also match
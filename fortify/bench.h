@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * bench.h: tiny helpers for the *-bench microbenchmarks.
+ *
+ * Each measurement is taken as BENCH_SAMPLES independent samples, each
+ * long enough (at least BENCH_SAMPLE_NS) to swamp clock overhead, and
+ * reported as a mean with a 95% confidence interval:
+ *
+ *     struct bench_result r;
+ *
+ *     BENCH(&r, iterations_per_op, {
+ *             memcpy(dst, src, size);
+ *             barrier_data(dst);
+ *     });
+ *     printf("%.2f ns/op +- %.2f\n", r.mean, r.ci95);
+ *
+ * The body is expanded inline, so whatever the compiler does at the call
+ * site (fortify checks, sanitizer instrumentation, vectorization) is
+ * exactly what gets timed.
+ */
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef BENCH_SAMPLES
+#define BENCH_SAMPLES	31
+#endif
+
+#ifndef BENCH_SAMPLE_NS
+#define BENCH_SAMPLE_NS	200000ULL
+#endif
+
+#ifndef noinline
+#define noinline __attribute__((__noinline__))
+#endif
+
+/* Make sure "ptr" is not elided by the compiler. */
+#ifndef barrier_data
+#define barrier_data(ptr) __asm__ __volatile__("": :"r"(ptr) :"memory")
+#endif
+
+/* Hide where a pointer came from, so its object size is unknown. */
+static noinline __attribute__((__unused__)) void *bench_hide(void *ptr)
+{
+	barrier_data(ptr);
+	return ptr;
+}
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Cycle counter where cheaply available, otherwise nanoseconds. */
+static inline uint64_t bench_now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return bench_now_ns();
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+# define BENCH_CYCLE_UNIT	"cycles"
+#else
+# define BENCH_CYCLE_UNIT	"ns"
+#endif
+
+struct bench_result {
+	double mean;	/* per op, in the unit of the clock used */
+	double ci95;	/* half-width of the 95% confidence interval */
+};
+
+static inline void bench_stats(struct bench_result *r, const double *samples,
+			       int n)
+{
+	double sum = 0, var = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+	r->mean = sum / n;
+	for (i = 0; i < n; i++)
+		var += (samples[i] - r->mean) * (samples[i] - r->mean);
+	var /= n > 1 ? n - 1 : 1;
+	/* Normal approximation; BENCH_SAMPLES is large enough for it. */
+	r->ci95 = 1.96 * sqrt(var / n);
+}
+
+/*
+ * Time "body", which performs "ops" operations per run, with the given
+ * clock. The run count per sample is calibrated first so each sample
+ * takes at least BENCH_SAMPLE_NS.
+ */
+#define __BENCH(result, ops, clock, body) do {				\
+	double __samples[BENCH_SAMPLES];				\
+	uint64_t __runs = 1, __i, __start, __end;			\
+	int __s;							\
+									\
+	for (;;) {							\
+		__start = bench_now_ns();				\
+		for (__i = 0; __i < __runs; __i++)			\
+			body						\
+		if (bench_now_ns() - __start >= BENCH_SAMPLE_NS)	\
+			break;						\
+		__runs *= 2;						\
+	}								\
+	for (__s = 0; __s < BENCH_SAMPLES; __s++) {			\
+		__start = clock();					\
+		for (__i = 0; __i < __runs; __i++)			\
+			body						\
+		__end = clock();					\
+		__samples[__s] = (double)(__end - __start) /		\
+				 ((double)__runs * (ops));		\
+	}								\
+	bench_stats(result, __samples, BENCH_SAMPLES);			\
+} while (0)
+
+/* Nanoseconds per operation. */
+#define BENCH(result, ops, body)					\
+	__BENCH(result, ops, bench_now_ns, body)
+
+/* Cycles (or nanoseconds, see BENCH_CYCLE_UNIT) per operation. */
+#define BENCH_CYCLES(result, ops, body)					\
+	__BENCH(result, ops, bench_now_cycles, body)
+
+#endif /* __BENCH_H */
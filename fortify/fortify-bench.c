@@ -0,0 +1,85 @@
+/*
+ * Measure the cost of FORTIFY_SOURCE on common string and memory
+ * functions. See Makefile: this is built once per _FORTIFY_SOURCE level
+ * (fortify-bench-0, -2 and -3) so the same table can be compared across
+ * levels and compilers.
+ *
+ * Each function is timed with a destination whose size is visible to
+ * __builtin_dynamic_object_size() (so the fortified wrapper has bounds
+ * to check) and with the same destination hidden behind a noinline
+ * call (so it does not).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#ifndef _FORTIFY_SOURCE
+# define FORTIFY_LEVEL	0
+#else
+# define FORTIFY_LEVEL	_FORTIFY_SOURCE
+#endif
+
+#define MAX_SIZE	4096
+
+/* Used to stop optimizer from seeing constant sizes. */
+volatile size_t unconst = 0;
+
+static const size_t sizes[] = { 1, 8, 16, 32, 64, 128, 256, 1024, MAX_SIZE };
+
+static char src[MAX_SIZE];
+
+static void report(const char *func, size_t size, const char *bounds,
+		   const struct bench_result *r)
+{
+	printf("%-10s %6zu  %-8s %10.2f %8.2f\n", func, size, bounds,
+	       r->mean, r->ci95);
+}
+
+/*
+ * "dst" is either the caller's fixed-size array (bounds visible) or the
+ * same array laundered through bench_hide() (bounds unknown).
+ */
+#define BENCH_FUNCS(dst, bounds, size) do {				\
+	struct bench_result r;						\
+	char *str = src + MAX_SIZE - (size);	/* strlen == size - 1 */\
+									\
+	BENCH(&r, 1, { memcpy(dst, src, size); barrier_data(dst); });	\
+	report("memcpy", size, bounds, &r);				\
+	BENCH(&r, 1, { memset(dst, 0x5a, size); barrier_data(dst); });	\
+	report("memset", size, bounds, &r);				\
+	BENCH(&r, 1, { strcpy(dst, str); barrier_data(dst); });		\
+	report("strcpy", size, bounds, &r);				\
+	BENCH(&r, 1, { strncpy(dst, src, size); barrier_data(dst); });	\
+	report("strncpy", size, bounds, &r);				\
+	BENCH(&r, 1, { snprintf(dst, size, "%s", str); barrier_data(dst); }); \
+	report("snprintf", size, bounds, &r);				\
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	char visible[MAX_SIZE];
+	char *hidden = bench_hide(visible);
+	size_t i, size;
+
+	memset(src, 'A', sizeof(src) - 1);
+	src[sizeof(src) - 1] = '\0';
+
+	printf("# %s: " __VERSION__ ", _FORTIFY_SOURCE=%d\n",
+	       argv[0], FORTIFY_LEVEL);
+	printf("# bdos(visible)=%zu bdos(hidden)=%zu\n",
+	       __builtin_dynamic_object_size(visible, 1),
+	       __builtin_dynamic_object_size(hidden, 1));
+	printf("# %-8s %6s  %-8s %10s %8s\n",
+	       "func", "size", "bounds", "ns/op", "+-95%");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		size = sizes[i] + unconst;
+		BENCH_FUNCS(visible, "visible", size);
+		BENCH_FUNCS(hidden, "hidden", size);
+	}
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+/* Checks for harness.h itself; see "make check" in the Makefile. */
+#include "harness.h"
+
+/*
+ * With --no-capture, a failed EXPECT is printed by the child and only
+ * counted through the ring: nothing may be added to the job's log.
+ */
+TEST(expect_failure)
+{
+	EXPECT_EQ(1, 2);
+	XFAIL(return, "EXPECT_EQ(1, 2) is meant to fail");
+}
+
+TEST_HARNESS_MAIN
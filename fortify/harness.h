@@ -54,22 +54,43 @@
 #define _GNU_SOURCE
 #endif
 #include <asm/types.h>
+#include <linux/memfd.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <setjmp.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
 
 #include "kselftest.h"
 
 #define TEST_TIMEOUT_DEFAULT 30
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
 /* Utilities exposed to the test definitions */
 #ifndef TH_LOG_STREAM
 #  define TH_LOG_STREAM stderr
@@ -95,6 +116,12 @@
  *
  * If no definition is provided, logging is enabled by default.
  *
+ * Unless the harness is run with --no-capture, the test's stdout and
+ * stderr are captured, and messages reach the harness through a ring in
+ * shared memory. All of it is printed along with the test's result, in
+ * the order it was written and each to its own stream, so the output of
+ * tests run concurrently does not interleave.
+ *
  * If there is no way to print an error message for the process running the
  * test (e.g. not allowed to write to stderr), it is still possible to get the
  * ASSERT_* number for which the test failed.  This behavior can be enabled by
@@ -108,10 +135,13 @@
 		__TH_LOG(fmt, ##__VA_ARGS__); \
 } while (0)
 
-/* Unconditional logger for internal use. */
+/* Unconditional loggers for internal use; see __th_log(). */
 #define __TH_LOG(fmt, ...) \
-		fprintf(TH_LOG_STREAM, "#\t\t\t%s:%d:%s:" fmt "\n", \
-			__FILE__, __LINE__, _metadata->name, ##__VA_ARGS__)
+		__TH_LOG_KIND(__TEST_REC_LOG, fmt, ##__VA_ARGS__)
+
+#define __TH_LOG_KIND(kind, fmt, ...) \
+		__th_log(kind, "#\t\t\t%s:%d:%s:" fmt, \
+			 __FILE__, __LINE__, _metadata->name, ##__VA_ARGS__)
 
 /**
  * SKIP()
@@ -131,8 +161,8 @@
 	snprintf(_metadata->results->reason, \
 		 sizeof(_metadata->results->reason), fmt, ##__VA_ARGS__); \
 	if (TH_LOG_ENABLED) { \
-		fprintf(TH_LOG_STREAM, "#      SKIP      %s\n", \
-			_metadata->results->reason); \
+		__th_log(__TEST_REC_LOG, "#      SKIP      %s", \
+			 _metadata->results->reason); \
 	} \
 	_metadata->passed = 1; \
 	_metadata->skip = 1; \
@@ -158,8 +188,8 @@
 	snprintf(_metadata->results->reason, \
 		 sizeof(_metadata->results->reason), fmt, ##__VA_ARGS__); \
 	if (TH_LOG_ENABLED) { \
-		fprintf(TH_LOG_STREAM, "#      XFAIL     %s\n", \
-			_metadata->results->reason); \
+		__th_log(__TEST_REC_LOG, "#      XFAIL     %s", \
+			 _metadata->results->reason); \
 	} \
 	_metadata->passed = 1; \
 	_metadata->xfail = 1; \
@@ -178,7 +208,8 @@
  *     TEST(name) { implementation }
  *
  * Defines a test by name.
- * Names must be unique and tests must not be run in parallel.  The
+ * Names must be unique.  Each test runs in its own process, possibly
+ * concurrently with other tests when the harness is run with -j.  The
  * implementation containing block is a function and scoping should be treated
  * as such.  Returning early may be performed with a bare "return;" statement.
  *
@@ -197,7 +228,8 @@
  *     TEST_SIGNAL(name, signal) { implementation }
  *
  * Defines a test by name and the expected term signal.
- * Names must be unique and tests must not be run in parallel.  The
+ * Names must be unique.  Each test runs in its own process, possibly
+ * concurrently with other tests when the harness is run with -j.  The
  * implementation containing block is a function and scoping should be treated
  * as such.  Returning early may be performed with a bare "return;" statement.
  *
@@ -212,20 +244,21 @@
 		struct __fixture_variant_metadata *variant) \
 	{ \
 		_metadata->setup_completed = true; \
+		_metadata->phase_start_ns = __th_clock(); \
 		if (setjmp(_metadata->env) == 0) \
 			test_name(_metadata); \
+		__test_phase_end(_metadata, __TEST_REC_TEST); \
 		__test_check_assert(_metadata); \
 	} \
 	static struct __test_metadata _##test_name##_object = \
 		{ .name = #test_name, \
 		  .fn = &wrapper_##test_name, \
 		  .fixture = &_fixture_global, \
+		  .order = __COUNTER__ + 1, \
 		  .termsig = _signal, \
 		  .timeout = TEST_TIMEOUT_DEFAULT, }; \
-	static void __attribute__((constructor)) _register_##test_name(void) \
-	{ \
-		__register_test(&_##test_name##_object); \
-	} \
+	__KSFT_REGISTER(ksft_tests, struct __test_metadata, \
+			_##test_name##_object); \
 	static void test_name( \
 		struct __test_metadata __attribute__((unused)) *_metadata)
 
@@ -265,12 +298,9 @@
 #define FIXTURE(fixture_name) \
 	FIXTURE_VARIANT(fixture_name); \
 	static struct __fixture_metadata _##fixture_name##_fixture_object = \
-		{ .name =  #fixture_name, }; \
-	static void __attribute__((constructor)) \
-	_register_##fixture_name##_data(void) \
-	{ \
-		__register_fixture(&_##fixture_name##_fixture_object); \
-	} \
+		{ .name =  #fixture_name, .order = __COUNTER__ + 1, }; \
+	__KSFT_REGISTER(ksft_fixtures, struct __fixture_metadata, \
+			_##fixture_name##_fixture_object); \
 	FIXTURE_DATA(fixture_name)
 
 /**
@@ -365,13 +395,11 @@
 	static struct __fixture_variant_metadata \
 		_##fixture_name##_##variant_name##_object = \
 		{ .name = #variant_name, \
-		  .data = &_##fixture_name##_##variant_name##_variant}; \
-	static void __attribute__((constructor)) \
-		_register_##fixture_name##_##variant_name(void) \
-	{ \
-		__register_fixture_variant(&_##fixture_name##_fixture_object, \
-			&_##fixture_name##_##variant_name##_object);	\
-	} \
+		  .data = &_##fixture_name##_##variant_name##_variant, \
+		  .fixture = &_##fixture_name##_fixture_object, \
+		  .order = __COUNTER__ + 1, }; \
+	__KSFT_REGISTER(ksft_variants, struct __fixture_variant_metadata, \
+			_##fixture_name##_##variant_name##_object); \
 	FIXTURE_VARIANT(fixture_name) \
 		_##fixture_name##_##variant_name##_variant =
 
@@ -411,16 +439,23 @@
 		/* fixture data is alloced, setup, and torn down per call. */ \
 		FIXTURE_DATA(fixture_name) self; \
 		memset(&self, 0, sizeof(FIXTURE_DATA(fixture_name))); \
+		_metadata->phase_start_ns = __th_clock(); \
 		if (setjmp(_metadata->env) == 0) { \
 			fixture_name##_setup(_metadata, &self, variant->data); \
+			__test_phase_end(_metadata, __TEST_REC_SETUP); \
 			/* Let setup failure terminate early. */ \
 			if (!_metadata->passed) \
 				return; \
 			_metadata->setup_completed = true; \
 			fixture_name##_##test_name(_metadata, &self, variant->data); \
 		} \
-		if (_metadata->setup_completed) \
+		/* An ASSERT may have cut either phase short. */ \
+		__test_phase_end(_metadata, _metadata->setup_completed ? \
+				 __TEST_REC_TEST : __TEST_REC_SETUP); \
+		if (_metadata->setup_completed) { \
 			fixture_name##_teardown(_metadata, &self, variant->data); \
+			__test_phase_end(_metadata, __TEST_REC_TEARDOWN); \
+		} \
 		__test_check_assert(_metadata); \
 	} \
 	static struct __test_metadata \
@@ -428,14 +463,12 @@
 		.name = #test_name, \
 		.fn = &wrapper_##fixture_name##_##test_name, \
 		.fixture = &_##fixture_name##_fixture_object, \
+		.order = __COUNTER__ + 1, \
 		.termsig = signal, \
 		.timeout = tmout, \
 	 }; \
-	static void __attribute__((constructor)) \
-			_register_##fixture_name##_##test_name(void) \
-	{ \
-		__register_test(&_##fixture_name##_##test_name##_object); \
-	} \
+	__KSFT_REGISTER(ksft_tests, struct __test_metadata, \
+			_##fixture_name##_##test_name##_object); \
 	static void fixture_name##_##test_name( \
 		struct __test_metadata __attribute__((unused)) *_metadata, \
 		FIXTURE_DATA(fixture_name) __attribute__((unused)) *self, \
@@ -452,12 +485,6 @@
  * Use once to append a main() to the test file.
  */
 #define TEST_HARNESS_MAIN \
-	static void __attribute__((constructor)) \
-	__constructor_order_last(void) \
-	{ \
-		if (!__constructor_order) \
-			__constructor_order = _CONSTRUCTOR_ORDER_BACKWARD; \
-	} \
 	int main(int argc, char **argv) { \
 		return test_harness_run(argc, argv); \
 	}
@@ -737,33 +764,37 @@
 		case 0: { \
 			unsigned long long __exp_print = (uintptr_t)__exp; \
 			unsigned long long __seen_print = (uintptr_t)__seen; \
-			__TH_LOG("Expected %s (%llu) %s %s (%llu)", \
-				 _expected_str, __exp_print, #_t, \
-				 _seen_str, __seen_print); \
+			__TH_LOG_KIND(__TEST_REC_EXPECT, \
+				      "Expected %s (%llu) %s %s (%llu)", \
+				      _expected_str, __exp_print, #_t, \
+				      _seen_str, __seen_print); \
 			break; \
 			} \
 		case 1: { \
 			unsigned long long __exp_print = (uintptr_t)__exp; \
 			long long __seen_print = (intptr_t)__seen; \
-			__TH_LOG("Expected %s (%llu) %s %s (%lld)", \
-				 _expected_str, __exp_print, #_t, \
-				 _seen_str, __seen_print); \
+			__TH_LOG_KIND(__TEST_REC_EXPECT, \
+				      "Expected %s (%llu) %s %s (%lld)", \
+				      _expected_str, __exp_print, #_t, \
+				      _seen_str, __seen_print); \
 			break; \
 			} \
 		case 2: { \
 			long long __exp_print = (intptr_t)__exp; \
 			unsigned long long __seen_print = (uintptr_t)__seen; \
-			__TH_LOG("Expected %s (%lld) %s %s (%llu)", \
-				 _expected_str, __exp_print, #_t, \
-				 _seen_str, __seen_print); \
+			__TH_LOG_KIND(__TEST_REC_EXPECT, \
+				      "Expected %s (%lld) %s %s (%llu)", \
+				      _expected_str, __exp_print, #_t, \
+				      _seen_str, __seen_print); \
 			break; \
 			} \
 		case 3: { \
 			long long __exp_print = (intptr_t)__exp; \
 			long long __seen_print = (intptr_t)__seen; \
-			__TH_LOG("Expected %s (%lld) %s %s (%lld)", \
-				 _expected_str, __exp_print, #_t, \
-				 _seen_str, __seen_print); \
+			__TH_LOG_KIND(__TEST_REC_EXPECT, \
+				      "Expected %s (%lld) %s %s (%lld)", \
+				      _expected_str, __exp_print, #_t, \
+				      _seen_str, __seen_print); \
 			break; \
 			} \
 		} \
@@ -778,78 +809,114 @@
 	const char *__seen = (_seen); \
 	if (_assert) __INC_STEP(_metadata); \
 	if (!(strcmp(__exp, __seen) _t 0))  { \
-		__TH_LOG("Expected '%s' %s '%s'.", __exp, #_t, __seen); \
+		__TH_LOG_KIND(__TEST_REC_EXPECT, "Expected '%s' %s '%s'.", \
+			      __exp, #_t, __seen); \
 		_metadata->passed = 0; \
 		_metadata->trigger = 1; \
 	} \
 } while (0); OPTIONAL_HANDLER(_assert)
 
-/* List helpers */
-#define __LIST_APPEND(head, item) \
-{ \
-	/* Circular linked list where only prev is circular. */ \
-	if (head == NULL) { \
-		head = item; \
-		item->next = NULL; \
-		item->prev = item; \
-		return;	\
-	} \
-	if (__constructor_order == _CONSTRUCTOR_ORDER_FORWARD) { \
-		item->next = NULL; \
-		item->prev = head->prev; \
-		item->prev->next = item; \
-		head->prev = item; \
-	} else { \
-		item->next = head; \
-		item->next->prev = item; \
-		item->prev = item; \
-		head = item; \
-	} \
-}
+/*
+ * Registration: every fixture, variant and test leaves a pointer to its
+ * metadata in a section of its own, and the linker gathers each section
+ * into an array bounded by __start_<section> and __stop_<section>.
+ * Nothing runs at startup, and counting is a subtraction. The arrays
+ * are put in declaration order (the "order" field, from __COUNTER__)
+ * by __test_registry_init(), since the compiler needn't emit objects
+ * in the order they are defined.
+ */
+#define __KSFT_REGISTER(name, type, object) \
+	static type *object##_entry __attribute__((__used__, \
+		__section__(#name), __aligned__(sizeof(void *)))) = &object
+
+/* Weak: a test file may declare no fixtures or variants of its own. */
+#define __KSFT_SECTION(name, type) \
+	extern type *__start_##name[] __attribute__((__weak__)); \
+	extern type *__stop_##name[] __attribute__((__weak__))
 
 struct __test_results {
 	char reason[1024];	/* Reason for test result */
 	unsigned int step;	/* Test step reached without failure */
 };
 
+/*
+ * Everything else a test child has to say goes through one ring of
+ * fixed-size records per run, shared by all children: see __ring_write()
+ * and __ring_drain().
+ */
+#ifndef TH_RING_RECORDS
+#  define TH_RING_RECORDS 4096
+#endif
+
+enum {
+	__TEST_REC_LOG,		/* TH_LOG(), SKIP() and XFAIL() */
+	__TEST_REC_EXPECT,	/* a failed EXPECT_* or ASSERT_* */
+	/* Phase durations, in ns: */
+	__TEST_REC_SETUP,
+	__TEST_REC_TEST,
+	__TEST_REC_TEARDOWN,
+};
+
+#define __TEST_NR_PHASES	(__TEST_REC_TEARDOWN - __TEST_REC_SETUP + 1)
+
+struct __test_record {
+	uint64_t seq;		/* slot + 1 once written, see __TEST_SEQ_DONE() */
+	unsigned int job;	/* index of the writer's job */
+	unsigned short kind;	/* __TEST_REC_* */
+	unsigned short len;	/* bytes used in text[] */
+	unsigned short index;	/* of this record within the message */
+	unsigned short count;	/* records in the message */
+	long long ns;		/* phase records only */
+	long long offset[2];	/* of the writer's captured stdout/stderr, or -1 */
+	char text[208];		/* makes the record 256 bytes */
+};
+
+/* Marks a slot as read, so the consumer can move the tail past it. */
+#define __TEST_SEQ_DONE(slot)	(((slot) + 1) | 1ULL << 63)
+
+struct __test_ring {
+	/* Slots count up forever; slot % TH_RING_RECORDS is the record. */
+	uint64_t head __attribute__((__aligned__(64)));	/* next free */
+	uint64_t tail __attribute__((__aligned__(64)));	/* oldest unread */
+	uint64_t dropped;	/* messages that found the ring full */
+	struct __test_record records[TH_RING_RECORDS];
+};
+
+/* Resources used by one test child, as reported by wait4(). */
+struct __test_rusage {
+	long long wall_ns;	/* from spawn to reap */
+	long long user_ns;
+	long long sys_ns;
+	long maxrss_kb;
+	long minflt;
+	long majflt;
+};
+
 struct __test_metadata;
 struct __fixture_variant_metadata;
 
 /* Contains all the information about a fixture. */
 struct __fixture_metadata {
 	const char *name;
-	struct __test_metadata *tests;
-	struct __fixture_variant_metadata *variant;
-	struct __fixture_metadata *prev, *next;
+	unsigned int order;	/* declaration order; 0 for the global one */
+	/* Filled in by __test_registry_init(). */
+	struct __test_metadata **tests;
+	unsigned int nr_tests;
+	struct __fixture_variant_metadata **variants;
+	unsigned int nr_variants;
 } _fixture_global __attribute__((unused)) = {
 	.name = "global",
-	.prev = &_fixture_global,
 };
 
-static struct __fixture_metadata *__fixture_list = &_fixture_global;
-static int __constructor_order;
-
-#define _CONSTRUCTOR_ORDER_FORWARD   1
-#define _CONSTRUCTOR_ORDER_BACKWARD -1
-
-static inline void __register_fixture(struct __fixture_metadata *f)
-{
-	__LIST_APPEND(__fixture_list, f);
-}
+__KSFT_REGISTER(ksft_fixtures, struct __fixture_metadata, _fixture_global);
 
 struct __fixture_variant_metadata {
 	const char *name;
 	const void *data;
-	struct __fixture_variant_metadata *prev, *next;
+	struct __fixture_metadata *fixture;
+	unsigned int order;
 };
 
-static inline void
-__register_fixture_variant(struct __fixture_metadata *f,
-			   struct __fixture_variant_metadata *variant)
-{
-	__LIST_APPEND(f->variant, variant);
-}
-
 /* Contains all the information for test execution and status checking. */
 struct __test_metadata {
 	const char *name;
@@ -869,21 +936,84 @@ struct __test_metadata {
 	bool setup_completed; /* did setup finish? */
 	jmp_buf env;	/* for exiting out of test early */
 	struct __test_results *results;
-	struct __test_metadata *prev, *next;
+	struct __test_rusage rusage;	/* filled in once the test is reaped */
+	unsigned int order;	/* declaration order */
+	long long phase_start_ns;	/* see __test_phase_end() */
 };
 
-/*
- * Since constructors are called in reverse order, reverse the test
- * list so tests are run in source declaration order.
- * https://gcc.gnu.org/onlinedocs/gccint/Initialization.html
- * However, it seems not all toolchains do this correctly, so use
- * __constructor_order to detect which direction is called first
- * and adjust list building logic to get things running in the right
- * direction.
- */
-static inline void __register_test(struct __test_metadata *t)
+__KSFT_SECTION(ksft_fixtures, struct __fixture_metadata);
+__KSFT_SECTION(ksft_variants, struct __fixture_variant_metadata);
+__KSFT_SECTION(ksft_tests, struct __test_metadata);
+
+static int __fixture_cmp(const void *a, const void *b)
 {
-	__LIST_APPEND(t->fixture->tests, t);
+	const struct __fixture_metadata *x = *(struct __fixture_metadata **)a;
+	const struct __fixture_metadata *y = *(struct __fixture_metadata **)b;
+
+	return (x->order > y->order) - (x->order < y->order);
+}
+
+/* Variants and tests: grouped by fixture, then in declaration order. */
+#define __MEMBER_CMP(x, y) \
+	((x)->fixture->order != (y)->fixture->order ? \
+	 ((x)->fixture->order > (y)->fixture->order) - \
+	 ((x)->fixture->order < (y)->fixture->order) : \
+	 ((x)->order > (y)->order) - ((x)->order < (y)->order))
+
+static int __variant_cmp(const void *a, const void *b)
+{
+	return __MEMBER_CMP(*(struct __fixture_variant_metadata **)a,
+			    *(struct __fixture_variant_metadata **)b);
+}
+
+static int __test_cmp(const void *a, const void *b)
+{
+	return __MEMBER_CMP(*(struct __test_metadata **)a,
+			    *(struct __test_metadata **)b);
+}
+
+/* Sort a registration array, unless the compiler kept it in order. */
+static void __registry_sort(void **entries, size_t count,
+			    int (*cmp)(const void *, const void *))
+{
+	size_t i;
+
+	for (i = 1; i < count; i++) {
+		if (cmp(&entries[i - 1], &entries[i]) > 0) {
+			qsort(entries, count, sizeof(*entries), cmp);
+			return;
+		}
+	}
+}
+
+/* Order the registration arrays, and point each fixture at its share. */
+static void __test_registry_init(void)
+{
+	size_t nr_fixtures = __stop_ksft_fixtures - __start_ksft_fixtures;
+	size_t nr_variants = __stop_ksft_variants - __start_ksft_variants;
+	size_t nr_tests = __stop_ksft_tests - __start_ksft_tests;
+	struct __fixture_variant_metadata **v = __start_ksft_variants;
+	struct __test_metadata **t = __start_ksft_tests;
+	struct __fixture_metadata *f;
+	size_t i;
+
+	__registry_sort((void **)__start_ksft_fixtures, nr_fixtures,
+			__fixture_cmp);
+	__registry_sort((void **)__start_ksft_variants, nr_variants,
+			__variant_cmp);
+	__registry_sort((void **)__start_ksft_tests, nr_tests, __test_cmp);
+
+	for (i = 0; i < nr_fixtures; i++) {
+		f = __start_ksft_fixtures[i];
+		f->variants = v;
+		while (v < __stop_ksft_variants && (*v)->fixture == f)
+			v++;
+		f->nr_variants = v - f->variants;
+		f->tests = t;
+		while (t < __stop_ksft_tests && (*t)->fixture == f)
+			t++;
+		f->nr_tests = t - f->tests;
+	}
 }
 
 static inline int __bail(int for_realz, struct __test_metadata *t)
@@ -906,63 +1036,405 @@ static inline void __test_check_assert(struct __test_metadata *t)
 	}
 }
 
-struct __test_metadata *__active_test;
-static void __timeout_handler(int sig, siginfo_t *info, void *ucontext)
+static inline long long __timespec_ns(const struct timespec *ts)
 {
-	struct __test_metadata *t = __active_test;
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
 
-	/* Sanity check handler execution environment. */
-	if (!t) {
-		fprintf(TH_LOG_STREAM,
-			"# no active test in SIGALRM handler!?\n");
-		abort();
+static inline long long __timeval_ns(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+}
+
+static inline long long __th_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return __timespec_ns(&now);
+}
+
+/* Shared with every test child, which writes as job __test_ring_job. */
+static struct __test_ring *__test_ring;
+static unsigned int __test_ring_job = -1;	/* -1 outside test children */
+static bool __test_captured;	/* stdout and stderr go to memfds */
+
+/*
+ * Append one message to the ring, as however many records it takes.
+ * Writers reserve consecutive slots by moving the head with a CAS, and
+ * fill them in without any lock. Each record is published by storing
+ * its seq last, and the first record of a message last of all, so a
+ * reader that sees the first record can read the whole message. Fails
+ * if the ring is full, or this isn't a test child.
+ */
+static bool __ring_write(unsigned int kind, long long ns,
+			 const char *text, size_t len)
+{
+	const size_t chunk = sizeof(__test_ring->records[0].text);
+	struct __test_ring *ring = __test_ring;
+	unsigned int i, count = len ? (len + chunk - 1) / chunk : 1;
+	struct __test_record *rec;
+	long long offset[2] = { -1, -1 };
+	uint64_t head, tail;
+
+	if (!ring || __test_ring_job == -1U || count > TH_RING_RECORDS)
+		return false;
+
+	/* Where the message goes among the test's own output. */
+	if (__test_captured && kind < __TEST_REC_SETUP) {
+		fflush(stdout);
+		offset[0] = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		offset[1] = lseek(STDERR_FILENO, 0, SEEK_CUR);
 	}
-	if (sig != SIGALRM || sig != info->si_signo) {
-		fprintf(TH_LOG_STREAM,
-			"# %s: SIGALRM handler caught signal %d!?\n",
-			t->name, sig != SIGALRM ? sig : info->si_signo);
-		abort();
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	do {
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head + count - tail > TH_RING_RECORDS) {
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&ring->head, &head, head + count,
+					      true, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	for (i = count; i-- > 0; ) {
+		rec = &ring->records[(head + i) % TH_RING_RECORDS];
+		rec->job = __test_ring_job;
+		rec->kind = kind;
+		rec->index = i;
+		rec->count = count;
+		rec->ns = ns;
+		rec->offset[0] = offset[0];
+		rec->offset[1] = offset[1];
+		rec->len = len - i * chunk < chunk ? len - i * chunk : chunk;
+		memcpy(rec->text, text + i * chunk, rec->len);
+		__atomic_store_n(&rec->seq, head + i + 1, __ATOMIC_RELEASE);
 	}
+	return true;
+}
 
-	t->timed_out = true;
-	// signal process group
-	kill(-(t->pid), SIGKILL);
+/*
+ * TH_LOG() and friends: a line for the ring, printed with the result. A
+ * test whose output isn't captured prints it straight away instead, as
+ * does one that finds the ring full.
+ */
+static void __attribute__((unused, format(printf, 2, 3)))
+__th_log(unsigned int kind, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (__test_captured && __ring_write(kind, 0, buf, len))
+		return;
+	fprintf(TH_LOG_STREAM, "%s\n", buf);
+	/* Still count the failure, without the text. */
+	if (kind == __TEST_REC_EXPECT)
+		__ring_write(kind, 0, "", 0);
 }
 
-void __wait_for_test(struct __test_metadata *t)
+/* Record how long a test phase took, and start timing the next one. */
+static inline void __test_phase_end(struct __test_metadata *t,
+				    unsigned int kind)
 {
-	struct sigaction action = {
-		.sa_sigaction = __timeout_handler,
-		.sa_flags = SA_SIGINFO,
-	};
-	struct sigaction saved_action;
-	int status;
+	long long now = __th_clock();
 
-	if (sigaction(SIGALRM, &action, &saved_action)) {
-		t->passed = 0;
-		fprintf(TH_LOG_STREAM,
-			"# %s: unable to install SIGALRM handler\n",
-			t->name);
+	__ring_write(kind, now - t->phase_start_ns, "", 0);
+	t->phase_start_ns = now;
+}
+
+/* A result from the cache in ~/.cache: see __cache_open(). */
+struct __test_cache_entry {
+	uint64_t hash;		/* __cache_test_hash() */
+	char outcome;		/* 'p'ass or 'x'fail */
+	unsigned int step;
+	char *reason;
+	char *log;		/* escaped, see __cache_escape() */
+};
+
+/* Up to "end", a job's log goes to "stream"; see __job_log(). */
+struct __test_log_part {
+	FILE *stream;
+	size_t end;
+};
+
+/* A single fixture/variant/test instance scheduled by test_harness_run(). */
+struct __test_job {
+	struct __fixture_metadata *f;
+	struct __fixture_variant_metadata *variant;
+	struct __test_metadata t;	/* private copy, so variants may overlap */
+	int pidfd;	/* readable once the test child exits */
+	int timerfd;	/* readable once the test timeout expires */
+	long long spawn_ns;	/* time taken to create the test child */
+	struct timespec start;	/* CLOCK_MONOTONIC when the test started */
+	int signal;	/* signal that terminated the child, if any */
+	unsigned int number;	/* TAP test number, counting earlier shards */
+	long long cost_ns;	/* wall time in the --costs run, or -1 */
+	uint64_t cache_hash;
+	const struct __test_cache_entry *cached;	/* if not run at all */
+	char *log;	/* drained from the ring, printed with the result */
+	size_t log_len;
+	struct __test_log_part *log_parts;
+	unsigned int nr_log_parts;
+	int output_fd[2];	/* memfds holding the child's stdout and stderr */
+	off_t output_done[2];	/* bytes of each already in the log */
+	unsigned int expect_failures;
+	long long phase_ns[__TEST_NR_PHASES];	/* -1 if not reached */
+	bool started;
+	bool announced;	/* has the "RUN" line been printed? */
+	bool done;
+};
+
+/* test_harness_run() options with no short form. */
+enum {
+	__OPT_STATS = 0x100,
+	__OPT_SHARD,
+	__OPT_COSTS,
+	__OPT_LIST_JSON,
+	__OPT_CACHE,
+	__OPT_NO_CAPTURE,
+};
+
+/* Maximum number of test children running at once (-j). */
+static int __test_jobs = 1;
+
+/* Capture the output of test children (unless --no-capture)... */
+static bool __test_capture = true;
+/* ...and print it only for tests that did not pass (-q). */
+static bool __test_quiet;
+
+/* epoll over every running job's pidfd and timerfd. */
+static int __test_epoll = -1;
+
+/* epoll_event data: job index, with the low bit set for the timerfd. */
+#define __TEST_EV_PID(idx)	((uint64_t)(idx) << 1)
+#define __TEST_EV_TIMER(idx)	(((uint64_t)(idx) << 1) | 1)
+
+static inline int sys_pidfd_open(pid_t pid, unsigned int flags)
+{
+	return syscall(__NR_pidfd_open, pid, flags);
+}
+
+/* Without glibc's memfd_create(), which needs _GNU_SOURCE early enough. */
+static inline int sys_memfd_create(const char *name, unsigned int flags)
+{
+	return syscall(__NR_memfd_create, name, flags);
+}
+
+static void __test_close_fd(int *fd)
+{
+	if (*fd < 0)
 		return;
+	/* Test children inherit these, so closing alone won't remove them. */
+	epoll_ctl(__test_epoll, EPOLL_CTL_DEL, *fd, NULL);
+	close(*fd);
+	*fd = -1;
+}
+
+/* Add to what gets printed to "stream" before the job's result. */
+static void __job_log(struct __test_job *job, FILE *stream,
+		      const char *text, size_t len)
+{
+	struct __test_log_part *part = NULL;
+	char *log;
+
+	if (!len)
+		return;
+	if (job->nr_log_parts)
+		part = &job->log_parts[job->nr_log_parts - 1];
+	if (!part || part->stream != stream) {
+		part = realloc(job->log_parts,
+			       (job->nr_log_parts + 1) * sizeof(*part));
+		if (!part)
+			return;
+		job->log_parts = part;
+		part += job->nr_log_parts++;
+		part->stream = stream;
+		part->end = job->log_len;
 	}
-	__active_test = t;
-	t->timed_out = false;
-	alarm(t->timeout);
-	waitpid(t->pid, &status, 0);
-	alarm(0);
-	if (sigaction(SIGALRM, &saved_action, NULL)) {
-		t->passed = 0;
-		fprintf(TH_LOG_STREAM,
-			"# %s: unable to uninstall SIGALRM handler\n",
-			t->name);
+	log = realloc(job->log, job->log_len + len);
+	if (!log)
 		return;
+	memcpy(log + job->log_len, text, len);
+	job->log = log;
+	job->log_len += len;
+	part->end = job->log_len;
+}
+
+/* Start the next message to "stream" on a line of its own. */
+static void __job_log_break(struct __test_job *job, FILE *stream)
+{
+	if (job->log_len &&
+	    job->log_parts[job->nr_log_parts - 1].stream == stream &&
+	    job->log[job->log_len - 1] != '\n')
+		__job_log(job, stream, "\n", 1);
+}
+
+/* Print the job's log, each part to its own stream, and forget it. */
+static void __job_log_flush(struct __test_job *job, bool print)
+{
+	struct __test_log_part *part;
+	size_t start = 0;
+
+	fflush(stdout);
+	for (part = job->log_parts;
+	     print && part < job->log_parts + job->nr_log_parts; part++) {
+		fwrite(job->log + start, 1, part->end - start, part->stream);
+		fflush(part->stream);
+		start = part->end;
 	}
-	__active_test = NULL;
+	free(job->log);
+	free(job->log_parts);
+	job->log = NULL;
+	job->log_parts = NULL;
+	job->log_len = 0;
+	job->nr_log_parts = 0;
+}
+
+/*
+ * Move what the child wrote to stdout ("fd" 0) or stderr ("fd" 1) into
+ * the job's log, up to offset "end" in its memfd, or all of it if "end"
+ * is negative.
+ */
+static void __job_output(struct __test_job *job, int fd, off_t end)
+{
+	FILE *stream = fd ? stderr : stdout;
+	char buf[4096];
+	size_t want;
+	ssize_t n;
+
+	if (job->output_fd[fd] < 0)
+		return;
+	while (end < 0 || job->output_done[fd] < end) {
+		want = sizeof(buf);
+		if (end >= 0 && end - job->output_done[fd] < (off_t)want)
+			want = end - job->output_done[fd];
+		n = pread(job->output_fd[fd], buf, want, job->output_done[fd]);
+		if (n <= 0)
+			break;
+		__job_log(job, stream, buf, n);
+		job->output_done[fd] += n;
+	}
+	/* Our result lines start on a line of their own. */
+	if (end < 0 && job->output_done[fd] &&
+	    pread(job->output_fd[fd], buf, 1, job->output_done[fd] - 1) == 1 &&
+	    buf[0] != '\n')
+		__job_log(job, stream, "\n", 1);
+}
+
+static void __job_close_output(struct __test_job *job)
+{
+	int fd;
+
+	for (fd = 0; fd < 2; fd++) {
+		if (job->output_fd[fd] >= 0)
+			close(job->output_fd[fd]);
+		job->output_fd[fd] = -1;
+	}
+}
+
+/*
+ * Read every complete message in the ring into its job, then free the
+ * slots up to the first one still being written. Messages from one
+ * child are in the order it wrote them. A child killed halfway through
+ * a write leaves slots that are never completed: once no child is left
+ * to complete anything ("idle"), they are dropped.
+ */
+static void __ring_drain(struct __test_job *jobs, bool idle)
+{
+	struct __test_ring *ring = __test_ring;
+	struct __test_record *rec;
+	struct __test_job *job;
+	uint64_t head, slot, end;
+	bool empty;
+
+	if (!ring)
+		return;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (slot = ring->tail; slot < head; slot++) {
+		rec = &ring->records[slot % TH_RING_RECORDS];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != slot + 1 ||
+		    rec->index)
+			continue;
+
+		job = &jobs[rec->job];
+		/* Captured output written before the message comes first. */
+		if (rec->offset[0] >= 0) {
+			__job_output(job, 0, rec->offset[0]);
+			__job_output(job, 1, rec->offset[1]);
+			__job_log_break(job, TH_LOG_STREAM);
+		}
+		switch (rec->kind) {
+		case __TEST_REC_EXPECT:
+			job->expect_failures++;
+			/* fallthrough */
+		case __TEST_REC_LOG:
+			/* Empty: only counted, printed by the child itself. */
+			empty = rec->count == 1 && !rec->len;
+			for (end = slot + rec->count; slot < end; slot++) {
+				rec = &ring->records[slot % TH_RING_RECORDS];
+				__job_log(job, TH_LOG_STREAM, rec->text, rec->len);
+				rec->seq = __TEST_SEQ_DONE(slot);
+			}
+			slot--;
+			if (!empty)
+				__job_log(job, TH_LOG_STREAM, "\n", 1);
+			break;
+		case __TEST_REC_SETUP ... __TEST_REC_TEARDOWN:
+			job->phase_ns[rec->kind - __TEST_REC_SETUP] = rec->ns;
+			/* fallthrough */
+		default:
+			rec->seq = __TEST_SEQ_DONE(slot);
+		}
+	}
+
+	if (idle) {
+		slot = head;
+	} else {
+		for (slot = ring->tail; slot < head; slot++) {
+			rec = &ring->records[slot % TH_RING_RECORDS];
+			if (rec->seq != __TEST_SEQ_DONE(slot))
+				break;
+		}
+	}
+	__atomic_store_n(&ring->tail, slot, __ATOMIC_RELEASE);
+}
+
+/* Report why a test did not pass, keeping the reason for -o output. */
+static void __attribute__((format(printf, 2, 3)))
+__test_diag(struct __test_job *job, const char *fmt, ...)
+{
+	struct __test_results *results = job->t.results;
+	char line[sizeof(results->reason) + 256];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	vsnprintf(results->reason, sizeof(results->reason), fmt, args);
+	va_end(args);
+	len = snprintf(line, sizeof(line), "# %s: %s\n", job->t.name,
+		       results->reason);
+	__job_log_break(job, TH_LOG_STREAM);
+	__job_log(job, TH_LOG_STREAM, line,
+		  len < sizeof(line) ? len : sizeof(line) - 1);
+}
+
+static void __test_exit_status(struct __test_job *job, int status)
+{
+	struct __test_metadata *t = &job->t;
 
 	if (t->timed_out) {
 		t->passed = 0;
-		fprintf(TH_LOG_STREAM,
-			"# %s: Test terminated by timeout\n", t->name);
+		__test_diag(job, "Test terminated by timeout");
 	} else if (WIFEXITED(status)) {
 		if (WEXITSTATUS(status) == KSFT_SKIP) {
 			/* SKIP */
@@ -973,10 +1445,8 @@ void __wait_for_test(struct __test_metadata *t)
 			t->xfail = 1;
 		} else if (t->termsig != -1) {
 			t->passed = 0;
-			fprintf(TH_LOG_STREAM,
-				"# %s: Test exited normally instead of by signal (code: %d)\n",
-				t->name,
-				WEXITSTATUS(status));
+			__test_diag(job, "Test exited normally instead of by signal (code: %d)",
+				    WEXITSTATUS(status));
 		} else {
 			switch (WEXITSTATUS(status)) {
 			/* Success */
@@ -986,141 +1456,1365 @@ void __wait_for_test(struct __test_metadata *t)
 			/* Other failure, assume step report. */
 			default:
 				t->passed = 0;
-				fprintf(TH_LOG_STREAM,
-					"# %s: Test failed at step #%d\n",
-					t->name,
-					t->results->step);
+				__test_diag(job, "Test failed at step #%d",
+					    t->results->step);
 			}
 		}
 	} else if (WIFSIGNALED(status)) {
 		t->passed = 0;
 		if (WTERMSIG(status) == SIGABRT) {
-			fprintf(TH_LOG_STREAM,
-				"# %s: Test terminated by assertion\n",
-				t->name);
+			__test_diag(job, "Test terminated by assertion");
 		} else if (WTERMSIG(status) == t->termsig) {
 			t->passed = 1;
 		} else {
-			fprintf(TH_LOG_STREAM,
-				"# %s: Test terminated unexpectedly by signal %d\n",
-				t->name,
-				WTERMSIG(status));
+			__test_diag(job, "Test terminated unexpectedly by signal %d",
+				    WTERMSIG(status));
 		}
 	} else {
-		fprintf(TH_LOG_STREAM,
-			"# %s: Test ended in some other way [%u]\n",
-			t->name,
-			status);
+		__test_diag(job, "Test ended in some other way [%u]", status);
 	}
 }
 
-void __run_test(struct __fixture_metadata *f,
-		struct __fixture_variant_metadata *variant,
-		struct __test_metadata *t)
+/*
+ * Wait for the next event from any running test: either a child exited
+ * (its pidfd became readable) or a per-test timerfd expired, in which
+ * case the test's process group is killed and we keep waiting for it.
+ */
+static struct __test_job *__wait_for_test(struct __test_job *jobs)
 {
-	const char *color_red = "\033[0;31m";
-	const char *color_green = "\033[0;32m";
-	const char *color_default = "\033[0m";
+	struct epoll_event ev;
+	struct __test_job *job;
+	struct rusage usage;
+	struct timespec now;
+	int status;
+	int n;
+
+	for (;;) {
+		n = epoll_wait(__test_epoll, &ev, 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+		job = &jobs[ev.data.u64 >> 1];
+
+		if (ev.data.u64 & 1) {
+			__test_close_fd(&job->timerfd);
+			job->t.timed_out = true;
+			// signal process group
+			kill(-(job->t.pid), SIGKILL);
+			continue;
+		}
 
-	if (!isatty(STDOUT_FILENO)) {
-	    color_red = "";
-	    color_green = "";
-	    color_default = "";
+		__test_close_fd(&job->pidfd);
+		__test_close_fd(&job->timerfd);
+		if (wait4(job->t.pid, &status, 0, &usage) < 0)
+			return NULL;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		job->t.rusage.wall_ns = __timespec_ns(&now) -
+					__timespec_ns(&job->start);
+		job->t.rusage.user_ns = __timeval_ns(&usage.ru_utime);
+		job->t.rusage.sys_ns = __timeval_ns(&usage.ru_stime);
+		job->t.rusage.maxrss_kb = usage.ru_maxrss;
+		job->t.rusage.minflt = usage.ru_minflt;
+		job->t.rusage.majflt = usage.ru_majflt;
+		job->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+		/* Everything the child wrote comes before our verdict. */
+		__ring_drain(jobs, false);
+		__job_output(job, 0, -1);
+		__job_output(job, 1, -1);
+		__job_close_output(job);
+		__test_exit_status(job, status);
+		job->done = true;
+		return job;
 	}
+}
 
-	/* reset test struct */
+/* Watch a freshly forked test child for exit and for its timeout. */
+static int __watch_test(struct __test_job *job, unsigned int idx)
+{
+	struct itimerspec deadline = { };
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+
+	job->pidfd = sys_pidfd_open(job->t.pid, 0);
+	if (job->pidfd < 0)
+		return -1;
+	ev.data.u64 = __TEST_EV_PID(idx);
+	if (epoll_ctl(__test_epoll, EPOLL_CTL_ADD, job->pidfd, &ev))
+		return -1;
+
+	job->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (job->timerfd < 0)
+		return -1;
+	deadline.it_value.tv_sec = job->t.timeout;
+	if (timerfd_settime(job->timerfd, 0, &deadline, NULL))
+		return -1;
+	ev.data.u64 = __TEST_EV_TIMER(idx);
+	if (epoll_ctl(__test_epoll, EPOLL_CTL_ADD, job->timerfd, &ev))
+		return -1;
+
+	return 0;
+}
+
+static void __announce_test(struct __test_job *job)
+{
+	ksft_print_msg(" RUN           %s%s%s.%s ...\n",
+		       job->f->name, job->variant->name[0] ? "." : "",
+		       job->variant->name, job->t.name);
+	job->announced = true;
+}
+
+static void __reset_test(struct __test_metadata *t)
+{
 	t->passed = 1;
 	t->skip = 0;
 	t->xfail = 0;
 	t->trigger = 0;
 	t->no_print = 0;
+	t->timed_out = false;
+}
+
+static void __attribute__((noreturn))
+__run_test_child(struct __test_job *job, unsigned int idx)
+{
+	struct __test_metadata *t = &job->t;
+
+	setpgrp();
+	__test_ring_job = idx;
+	if (job->output_fd[0] >= 0) {
+		/* Whatever the parent hadn't flushed yet is its own business. */
+		__fpurge(stdout);
+		__fpurge(stderr);
+		dup2(job->output_fd[0], STDOUT_FILENO);
+		dup2(job->output_fd[1], STDERR_FILENO);
+		__job_close_output(job);
+		/* As on a terminal, so _exit() loses at most a partial line. */
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		__test_captured = true;
+	}
+	t->fn(t, job->variant);
+	fflush(stdout);
+	if (t->skip)
+		_exit(KSFT_SKIP);
+	if (t->xfail)
+		_exit(KSFT_XFAIL);
+	if (t->passed)
+		_exit(KSFT_PASS);
+	/* Something else happened. */
+	_exit(KSFT_FAIL);
+}
+
+static pid_t __spawn_test(struct __test_job *job, unsigned int idx)
+{
+	pid_t pid;
+
+	/*
+	 * A child whose output is captured drops what it inherits in our
+	 * stdio buffers; any other writes where we do, so our output has
+	 * to go out first.
+	 */
+	if (job->output_fd[0] < 0) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+
+	pid = fork();
+	if (pid == 0)
+		__run_test_child(job, idx);
+	return pid;
+}
+
+static void __start_test(struct __test_job *job, unsigned int idx)
+{
+	struct __test_metadata *t = &job->t;
+	struct timespec after;
+	unsigned int i;
+
+	/* reset test struct */
+	__reset_test(t);
 	memset(t->results->reason, 0, sizeof(t->results->reason));
 	t->results->step = 1;
 
-	ksft_print_msg(" RUN           %s%s%s.%s ...\n",
-	       f->name, variant->name[0] ? "." : "", variant->name, t->name);
+	job->pidfd = -1;
+	job->timerfd = -1;
+	job->output_fd[0] = -1;
+	job->output_fd[1] = -1;
+	job->output_done[0] = 0;
+	job->output_done[1] = 0;
+	job->started = true;
+	for (i = 0; i < __TEST_NR_PHASES; i++)
+		job->phase_ns[i] = -1;
+
+	/* Known result for this exact build and test: no child needed. */
+	if (job->cached) {
+		t->passed = 1;
+		t->xfail = job->cached->outcome == 'x';
+		t->results->step = job->cached->step;
+		snprintf(t->results->reason, sizeof(t->results->reason),
+			 "%s", job->cached->reason);
+		job->done = true;
+		return;
+	}
 
-	/* Make sure output buffers are flushed before fork */
-	fflush(stdout);
-	fflush(stderr);
+	/* Without memfds, the child's output just isn't captured. */
+	if (__test_capture) {
+		job->output_fd[0] = sys_memfd_create("ksft-stdout", MFD_CLOEXEC);
+		job->output_fd[1] = sys_memfd_create("ksft-stderr", MFD_CLOEXEC);
+		if (job->output_fd[0] < 0 || job->output_fd[1] < 0)
+			__job_close_output(job);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	t->pid = __spawn_test(job, idx);
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	job->spawn_ns = __timespec_ns(&after) - __timespec_ns(&job->start);
 
-	t->pid = fork();
 	if (t->pid < 0) {
 		ksft_print_msg("ERROR SPAWNING TEST CHILD\n");
 		t->passed = 0;
-	} else if (t->pid == 0) {
-		setpgrp();
-		t->fn(t, variant);
-		if (t->skip)
-			_exit(KSFT_SKIP);
-		if (t->xfail)
-			_exit(KSFT_XFAIL);
-		if (t->passed)
-			_exit(KSFT_PASS);
-		/* Something else happened. */
-		_exit(KSFT_FAIL);
-	} else {
-		__wait_for_test(t);
+		job->done = true;
+	} else if (__watch_test(job, idx)) {
+		fprintf(TH_LOG_STREAM, "# %s: unable to watch test child: %s\n",
+			t->name, strerror(errno));
+		kill(-(t->pid), SIGKILL);
+		__test_close_fd(&job->pidfd);
+		__test_close_fd(&job->timerfd);
+		waitpid(t->pid, NULL, 0);
+		t->passed = 0;
+		job->done = true;
+	}
+	if (job->done)
+		__job_close_output(job);
+}
+
+/*
+ * Structured result streams (-o json:FILE, -o junit:FILE). All records
+ * go through one buffer per stream, written out with write(2) only when
+ * it fills up or the run ends.
+ */
+struct __th_writer {
+	int fd;
+	size_t len;
+	char buf[65536];
+};
+
+static struct __th_writer *__th_json, *__th_junit;
+
+static void __th_flush(struct __th_writer *w)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < w->len) {
+		n = write(w->fd, w->buf + done, w->len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += n;
+	}
+	w->len = 0;
+}
+
+static inline void __th_putc(struct __th_writer *w, char c)
+{
+	if (w->len == sizeof(w->buf))
+		__th_flush(w);
+	w->buf[w->len++] = c;
+}
+
+static void __attribute__((format(printf, 2, 3)))
+__th_printf(struct __th_writer *w, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, fmt, args);
+	va_end(args);
+	if (n >= 0 && w->len + n < sizeof(w->buf)) {
+		w->len += n;
+		return;
+	}
+
+	/* Didn't fit: flush and format again into the empty buffer. */
+	__th_flush(w);
+	va_start(args, fmt);
+	n = vsnprintf(w->buf, sizeof(w->buf), fmt, args);
+	va_end(args);
+	if (n > 0)
+		w->len = n < sizeof(w->buf) ? n : sizeof(w->buf) - 1;
+}
+
+static void __th_puts_json(struct __th_writer *w, const char *str)
+{
+	const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	__th_putc(w, '"');
+	for (; (c = *str); str++) {
+		if (c == '"' || c == '\\') {
+			__th_putc(w, '\\');
+			__th_putc(w, c);
+		} else if (c < 0x20) {
+			__th_printf(w, "\\u00%c%c", hex[c >> 4], hex[c & 0xf]);
+		} else {
+			__th_putc(w, c);
+		}
+	}
+	__th_putc(w, '"');
+}
+
+static void __th_puts_xml(struct __th_writer *w, const char *str)
+{
+	unsigned char c;
+
+	for (; (c = *str); str++) {
+		switch (c) {
+		case '&': __th_printf(w, "&amp;"); break;
+		case '<': __th_printf(w, "&lt;"); break;
+		case '>': __th_printf(w, "&gt;"); break;
+		case '"': __th_printf(w, "&quot;"); break;
+		default:
+			/* XML 1.0 cannot carry most control characters. */
+			__th_putc(w, c < 0x20 && c != '\t' && c != '\n' ? '?' : c);
+		}
+	}
+}
+
+/* "flags" is O_TRUNC or O_APPEND. */
+static struct __th_writer *__th_open(const char *path, int flags)
+{
+	struct __th_writer *w;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return NULL;
+	w->len = 0;
+	w->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0644);
+	if (w->fd < 0) {
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static void __th_close(struct __th_writer **w)
+{
+	if (!*w)
+		return;
+	__th_flush(*w);
+	close((*w)->fd);
+	free(*w);
+	*w = NULL;
+}
+
+static const char *__test_outcome(struct __test_job *job)
+{
+	if (job->t.timed_out)
+		return "timeout";
+	if (job->t.skip)
+		return "skip";
+	if (job->t.xfail)
+		return "xfail";
+	return job->t.passed ? "pass" : "fail";
+}
+
+static void __emit_json(struct __th_writer *w, struct __test_job *job)
+{
+	const struct __test_rusage *ru = &job->t.rusage;
+
+	__th_printf(w, "{\"number\":%u,\"fixture\":", job->number);
+	__th_puts_json(w, job->f->name);
+	__th_printf(w, ",\"variant\":");
+	__th_puts_json(w, job->variant->name);
+	__th_printf(w, ",\"test\":");
+	__th_puts_json(w, job->t.name);
+	__th_printf(w, ",\"outcome\":\"%s\",\"cached\":%s,\"termsig\":%d,\"step\":%u,\"reason\":",
+		    __test_outcome(job), job->cached ? "true" : "false",
+		    job->signal, job->t.results->step);
+	__th_puts_json(w, job->t.results->reason);
+	__th_printf(w, ",\"expect_failures\":%u,\"setup_ns\":%lld,\"test_ns\":%lld,\"teardown_ns\":%lld",
+		    job->expect_failures, job->phase_ns[0], job->phase_ns[1],
+		    job->phase_ns[2]);
+	__th_printf(w, ",\"wall_ns\":%lld,\"cpu_ns\":%lld,\"user_ns\":%lld,\"sys_ns\":%lld,"
+		    "\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld}\n",
+		    ru->wall_ns, ru->user_ns + ru->sys_ns, ru->user_ns,
+		    ru->sys_ns, ru->maxrss_kb, ru->minflt, ru->majflt);
+}
+
+static void __emit_junit(struct __th_writer *w, struct __test_job *job)
+{
+	const struct __test_rusage *ru = &job->t.rusage;
+	const char *outcome = __test_outcome(job);
+
+	__th_printf(w, "  <testcase classname=\"");
+	__th_puts_xml(w, job->f->name);
+	if (job->variant->name[0]) {
+		__th_putc(w, '.');
+		__th_puts_xml(w, job->variant->name);
+	}
+	__th_printf(w, "\" name=\"");
+	__th_puts_xml(w, job->t.name);
+	__th_printf(w, "\" time=\"%lld.%09lld\">\n",
+		    ru->wall_ns / 1000000000LL, ru->wall_ns % 1000000000LL);
+	__th_printf(w, "    <properties><property name=\"outcome\" value=\"%s\"/>"
+		    "<property name=\"termsig\" value=\"%d\"/>"
+		    "<property name=\"step\" value=\"%u\"/>"
+		    "<property name=\"user_ns\" value=\"%lld\"/>"
+		    "<property name=\"sys_ns\" value=\"%lld\"/>"
+		    "<property name=\"maxrss_kb\" value=\"%ld\"/>"
+		    "<property name=\"minflt\" value=\"%ld\"/>"
+		    "<property name=\"majflt\" value=\"%ld\"/></properties>\n",
+		    outcome, job->signal, job->t.results->step, ru->user_ns,
+		    ru->sys_ns, ru->maxrss_kb, ru->minflt, ru->majflt);
+	if (!job->t.passed || job->t.skip) {
+		__th_printf(w, "    <%s message=\"",
+			    job->t.skip ? "skipped" : "failure");
+		__th_puts_xml(w, job->t.results->reason);
+		__th_printf(w, "\" type=\"%s\"/>\n", outcome);
+	}
+	__th_printf(w, "  </testcase>\n");
+}
+
+/*
+ * Result cache (--cache). A test's outcome only depends on the
+ * compiler, the flags it was built with and its source, so a pass or
+ * xfail already seen for the same combination is reported again, with
+ * the same log, without forking. The Makefile bakes in TH_BUILD_FLAGS
+ * and TH_SOURCE_HASH (a checksum of the test file and everything it
+ * includes); without them there is no cache. Each build gets one
+ * append-only file of "<test hash> <outcome> <step> <reason>\t<log>"
+ * lines, so concurrent runs (e.g. shards on one machine) can safely add
+ * to it. Failures are never cached, since rerunning them is how their
+ * logs get seen, and neither are skips, which usually depend on the
+ * machine rather than the build.
+ */
+#define TH_CACHE_DIR	".cache/ksft-harness"
+
+#ifdef TH_SOURCE_HASH
+# define TH_CACHE	1
+#else
+# define TH_CACHE	0
+# define TH_SOURCE_HASH	""
+# define TH_BUILD_FLAGS	""
+#endif
+
+static struct __test_cache_entry *__cache_entries;
+static size_t __cache_count;
+static int __cache_fd = -1;	/* O_APPEND, shared with other shards */
+
+/* 64-bit FNV-1a, with each string's terminator mixed in as well. */
+static uint64_t __cache_hash(uint64_t hash, const char *str)
+{
+	do {
+		hash ^= (unsigned char)*str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+	return hash;
+}
+
+static uint64_t __cache_test_hash(uint64_t build, const struct __test_job *job)
+{
+	char limits[64];
+
+	snprintf(limits, sizeof(limits), "%d %d", job->t.termsig,
+		 job->t.timeout);
+	build = __cache_hash(build, job->f->name);
+	build = __cache_hash(build, job->variant->name);
+	build = __cache_hash(build, job->t.name);
+	return __cache_hash(build, limits);
+}
+
+/*
+ * Write "text" to "fp" with backslashes, tabs and newlines escaped, so
+ * it fits in one field of a cache line.
+ */
+static void __cache_escape(FILE *fp, const char *text, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (text[i] == '\\')
+			fputs("\\\\", fp);
+		else if (text[i] == '\t')
+			fputs("\\t", fp);
+		else if (text[i] == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(text[i], fp);
+	}
+}
+
+/*
+ * Undo __cache_escape() in place, up to a "\o" or "\e" (the start of
+ * the next log part) or the end. Returns where decoding stopped.
+ */
+static char *__cache_unescape(char *text, size_t *len)
+{
+	char *in = text, *out = text;
+
+	for (; *in; in++) {
+		if (*in != '\\' || !in[1]) {
+			*out++ = *in;
+			continue;
+		}
+		if (in[1] == 'o' || in[1] == 'e')
+			break;
+		in++;
+		*out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in;
+	}
+	*len = out - text;
+	return in;
+}
+
+static int __cache_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const struct __test_cache_entry *)a)->hash;
+	uint64_t y = ((const struct __test_cache_entry *)b)->hash;
+
+	return (x > y) - (x < y);
+}
+
+static void __cache_load(FILE *fp)
+{
+	struct __test_cache_entry *entry;
+	unsigned long long hash;
+	size_t size = 0, alloc = 0;
+	char *line = NULL, *log, outcome[8];
+	unsigned int step;
+	size_t reason_len;
+	int len;
+
+	while (getline(&line, &size, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		/* Not " %n": that would skip an empty reason's tab too. */
+		if (sscanf(line, "%llx %7s %u%n", &hash, outcome, &step,
+			   &len) != 3 || line[len++] != ' ')
+			continue;
+		if (strcmp(outcome, "pass") && strcmp(outcome, "xfail"))
+			continue;
+		log = strchr(line + len, '\t');
+		if (!log)
+			continue;
+		*log++ = '\0';
+		__cache_unescape(line + len, &reason_len);
+		line[len + reason_len] = '\0';
+		if (__cache_count == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			__cache_entries = realloc(__cache_entries,
+						  alloc * sizeof(*__cache_entries));
+			if (!__cache_entries)
+				ksft_exit_fail_msg("Unable to allocate %zu cache entries\n",
+						   alloc);
+		}
+		entry = &__cache_entries[__cache_count++];
+		entry->hash = hash;
+		entry->outcome = outcome[0];
+		entry->step = step;
+		entry->reason = strdup(line + len);
+		entry->log = strdup(log);
+		if (!entry->reason || !entry->log)
+			ksft_exit_fail_msg("Unable to allocate cache entries\n");
+	}
+	free(line);
+	qsort(__cache_entries, __cache_count, sizeof(*__cache_entries),
+	      __cache_cmp);
+}
+
+/*
+ * Open (creating it if needed) this build's cache file, and mark each
+ * job it already holds a result for. Returns how many were found.
+ */
+static unsigned int __cache_open(const char *argv0, struct __test_job *jobs,
+				 unsigned int count)
+{
+	const char *home = getenv("HOME"), *base = strrchr(argv0, '/');
+	struct __test_cache_entry key;
+	unsigned int i, found = 0;
+	uint64_t build;
+	char path[4096];
+	FILE *fp;
+
+	if (!TH_CACHE || !home || !*home)
+		return 0;
+	snprintf(path, sizeof(path), "%s/.cache", home);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/" TH_CACHE_DIR, home);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return 0;
+
+	build = __cache_hash(0xcbf29ce484222325ULL, __VERSION__);
+	build = __cache_hash(build, TH_BUILD_FLAGS);
+	build = __cache_hash(build, TH_SOURCE_HASH);
+#ifdef __GLIBC__
+	/* Fortified functions are checked by libc, not the compiler. */
+	build = __cache_hash(build, gnu_get_libc_version());
+#endif
+	snprintf(path, sizeof(path), "%s/" TH_CACHE_DIR "/%s-%016llx", home,
+		 base ? base + 1 : argv0, (unsigned long long)build);
+
+	fp = fopen(path, "r");
+	if (fp) {
+		__cache_load(fp);
+		fclose(fp);
+	}
+	__cache_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	for (i = 0; i < count; i++) {
+		jobs[i].cache_hash = __cache_test_hash(build, &jobs[i]);
+		key.hash = jobs[i].cache_hash;
+		jobs[i].cached = bsearch(&key, __cache_entries, __cache_count,
+					 sizeof(*__cache_entries), __cache_cmp);
+		if (jobs[i].cached)
+			found++;
+	}
+	return found;
+}
+
+/*
+ * Remember a freshly run test's result and log, unless it failed or
+ * skipped. Without capture, the log lacks the test's own output, so
+ * nothing is remembered then either.
+ */
+static void __cache_record(struct __test_job *job)
+{
+	struct __test_log_part *part;
+	size_t size, start = 0;
+	char *line;
+	FILE *fp;
+
+	if (__cache_fd < 0 || job->cached || !__test_capture ||
+	    !job->t.passed || job->t.skip || job->t.timed_out)
+		return;
+	fp = open_memstream(&line, &size);
+	if (!fp)
+		return;
+	fprintf(fp, "%016llx %s %u ", (unsigned long long)job->cache_hash,
+		__test_outcome(job), job->t.results->step);
+	__cache_escape(fp, job->t.results->reason,
+		       strnlen(job->t.results->reason,
+			       sizeof(job->t.results->reason)));
+	fputc('\t', fp);
+	for (part = job->log_parts;
+	     part < job->log_parts + job->nr_log_parts; part++) {
+		fputs(part->stream == stdout ? "\\o" : "\\e", fp);
+		__cache_escape(fp, job->log + start, part->end - start);
+		start = part->end;
+	}
+	fputc('\n', fp);
+	if (fclose(fp)) {
+		free(line);
+		return;
+	}
+	/*
+	 * A single write() per line: with O_APPEND, lines from shards
+	 * running at the same time can't end up interleaved.
+	 */
+	if (write(__cache_fd, line, size) != (ssize_t)size) {
+		/* Out of space, probably: stop adding to the cache. */
+		close(__cache_fd);
+		__cache_fd = -1;
 	}
+	free(line);
+}
+
+/* Put a cached test's log back, each part on its own stream. */
+static void __cache_replay(struct __test_job *job)
+{
+	char *log, *part, *end;
+	FILE *stream;
+	size_t len;
+
+	log = strdup(job->cached->log);
+	if (!log)
+		return;
+	for (part = log; part[0] == '\\' && (part[1] == 'o' || part[1] == 'e');
+	     part = end) {
+		stream = part[1] == 'o' ? stdout : stderr;
+		end = __cache_unescape(part + 2, &len);
+		__job_log(job, stream, part + 2, len);
+	}
+	free(log);
+}
+
+static void __report_test(struct __test_job *job)
+{
+	struct __fixture_metadata *f = job->f;
+	struct __fixture_variant_metadata *variant = job->variant;
+	struct __test_metadata *t = &job->t;
+	const char *color_red = "\033[0;31m";
+	const char *color_green = "\033[0;32m";
+	const char *color_default = "\033[0m";
+
+	if (!isatty(STDOUT_FILENO)) {
+	    color_red = "";
+	    color_green = "";
+	    color_default = "";
+	}
+
+	if (job->cached)
+		__cache_replay(job);
+	else
+		__cache_record(job);
+	if (job->log_len)
+		__job_log_flush(job, !__test_quiet || !t->passed);
 	ksft_print_msg("         %s%4s%s  %s%s%s.%s\n",
 		       t->passed ? color_green : color_red,
 		       t->passed ? "OK" : "FAIL", color_default,
 		       f->name, variant->name[0] ? "." : "", variant->name, t->name);
 
 	if (t->skip)
-		ksft_test_result_skip("%s\n", t->results->reason[0] ?
-					t->results->reason : "unknown");
+		ksft_test_result_skip("%s%s\n", t->results->reason[0] ?
+					t->results->reason : "unknown",
+				      job->cached ? " (cached)" : "");
 	else if (t->xfail)
-		ksft_test_result_xfail("%s\n", t->results->reason[0] ?
-				       t->results->reason : "unknown");
+		ksft_test_result_xfail("%s%s\n", t->results->reason[0] ?
+				       t->results->reason : "unknown",
+				       job->cached ? " (cached)" : "");
 	else
-		ksft_test_result(t->passed, "%s%s%s.%s\n",
-			f->name, variant->name[0] ? "." : "", variant->name, t->name);
+		ksft_test_result(t->passed, "%s%s%s.%s%s\n",
+			f->name, variant->name[0] ? "." : "", variant->name, t->name,
+			job->cached ? " # cached" : "");
+
+	if (__th_json)
+		__emit_json(__th_json, job);
+	if (__th_junit)
+		__emit_junit(__th_junit, job);
+}
+
+/* Summarize the resources used by all tests, and the hungriest ones. */
+static void __report_rusage(struct __test_job *jobs, unsigned int count)
+{
+	struct __test_job *slowest = jobs, *biggest = jobs;
+	struct __test_rusage total = { };
+	const struct __test_rusage *ru;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		ru = &jobs[i].t.rusage;
+		total.wall_ns += ru->wall_ns;
+		total.user_ns += ru->user_ns;
+		total.sys_ns += ru->sys_ns;
+		total.minflt += ru->minflt;
+		total.majflt += ru->majflt;
+		if (ru->wall_ns > slowest->t.rusage.wall_ns)
+			slowest = &jobs[i];
+		if (ru->maxrss_kb > biggest->t.rusage.maxrss_kb)
+			biggest = &jobs[i];
+	}
+
+	ksft_print_msg("Resources: wall %lld.%03llds user %lld.%03llds sys %lld.%03llds faults %ld minor %ld major\n",
+		       total.wall_ns / 1000000000LL,
+		       total.wall_ns / 1000000LL % 1000,
+		       total.user_ns / 1000000000LL,
+		       total.user_ns / 1000000LL % 1000,
+		       total.sys_ns / 1000000000LL,
+		       total.sys_ns / 1000000LL % 1000,
+		       total.minflt, total.majflt);
+	ksft_print_msg("Slowest: %s%s%s.%s (%lld.%03llds)\n",
+		       slowest->f->name, slowest->variant->name[0] ? "." : "",
+		       slowest->variant->name, slowest->t.name,
+		       slowest->t.rusage.wall_ns / 1000000000LL,
+		       slowest->t.rusage.wall_ns / 1000000LL % 1000);
+	ksft_print_msg("Max RSS: %s%s%s.%s (%ld KiB)\n",
+		       biggest->f->name, biggest->variant->name[0] ? "." : "",
+		       biggest->variant->name, biggest->t.name,
+		       biggest->t.rusage.maxrss_kb);
+}
+
+/* A command line test selector, see __usage(). */
+struct __test_filter {
+	int kind;	/* 'f', 'v', 't' include; 'F', 'V', 'T' exclude; 'r' */
+	const char *pattern;
+	regex_t re;	/* only for 'r' */
+};
+
+static struct __test_filter *__test_filters;
+static unsigned int __test_filter_count;
+
+static bool __test_filter_match(const struct __test_filter *filter,
+				const char *fixture, const char *variant,
+				const char *test, const char *full)
+{
+	switch (filter->kind) {
+	case 'f': case 'F':
+		return fnmatch(filter->pattern, fixture, 0) == 0;
+	case 'v': case 'V':
+		return fnmatch(filter->pattern, variant, 0) == 0;
+	case 't': case 'T':
+		return fnmatch(filter->pattern, test, 0) == 0;
+	case 'r':
+		return regexec(&filter->re, full, 0, NULL, 0) == 0;
+	}
+	return false;
+}
+
+/*
+ * A test runs when it matches no exclusion and, for every kind of
+ * inclusion given (-f, -v, -t, -r), at least one pattern of that kind.
+ */
+static bool __test_selected(struct __fixture_metadata *f,
+			    struct __fixture_variant_metadata *v,
+			    struct __test_metadata *t)
+{
+	bool matched[128] = { };
+	const struct __test_filter *filter;
+	char full[1024];
+	unsigned int i;
+
+	snprintf(full, sizeof(full), "%s%s%s.%s",
+		 f->name, v->name[0] ? "." : "", v->name, t->name);
+
+	for (i = 0; i < __test_filter_count; i++) {
+		filter = &__test_filters[i];
+		if (!__test_filter_match(filter, f->name, v->name,
+					 t->name, full))
+			continue;
+		if (filter->kind == 'F' || filter->kind == 'V' ||
+		    filter->kind == 'T')
+			return false;
+		matched[filter->kind] = true;
+	}
+	for (i = 0; i < __test_filter_count; i++) {
+		filter = &__test_filters[i];
+		if (islower(filter->kind) && !matched[filter->kind])
+			return false;
+	}
+	return true;
+}
+
+/* A test's wall time in an earlier run, from its -o json:FILE results. */
+struct __test_cost {
+	char *name;	/* fixture[.variant].test */
+	long long wall_ns;
+};
+
+static struct __test_cost *__test_costs;
+static size_t __test_cost_count;
+
+/* Decode the string following "key" (which ends in its opening quote). */
+static bool __json_string(const char *line, const char *key,
+			  char *buf, size_t size)
+{
+	const char *p = strstr(line, key);
+	unsigned int c;
+	size_t len = 0;
+
+	if (!p)
+		return false;
+	for (p += strlen(key); *p && *p != '"'; p++) {
+		c = (unsigned char)*p;
+		if (c == '\\') {
+			c = (unsigned char)*++p;
+			if (c == 'u') {
+				if (sscanf(p + 1, "%4x", &c) != 1)
+					return false;
+				p += 4;
+			} else if (!c) {
+				return false;
+			}
+		}
+		if (len + 1 >= size)
+			return false;
+		buf[len++] = c;
+	}
+	buf[len] = '\0';
+	return *p == '"';
+}
+
+static int __test_cost_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct __test_cost *)a)->name,
+		      ((const struct __test_cost *)b)->name);
+}
+
+/* Read the wall times recorded by an earlier run's -o json:FILE. */
+static bool __load_costs(const char *path)
+{
+	char fixture[256], variant[256], test[256];
+	struct __test_cost *cost;
+	size_t size = 0, alloc = 0, len;
+	char *line = NULL;
+	const char *wall;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+	while (getline(&line, &size, fp) > 0) {
+		wall = strstr(line, "\"wall_ns\":");
+		if (!wall ||
+		    !__json_string(line, "\"fixture\":\"", fixture, sizeof(fixture)) ||
+		    !__json_string(line, "\"variant\":\"", variant, sizeof(variant)) ||
+		    !__json_string(line, "\"test\":\"", test, sizeof(test)))
+			continue;
+		if (__test_cost_count == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			__test_costs = realloc(__test_costs,
+					       alloc * sizeof(*__test_costs));
+			if (!__test_costs)
+				ksft_exit_fail_msg("Unable to allocate %zu test costs\n",
+						   alloc);
+		}
+		cost = &__test_costs[__test_cost_count++];
+		/* Not asprintf(): stdio may come before our _GNU_SOURCE. */
+		len = strlen(fixture) + strlen(variant) + strlen(test) + 3;
+		cost->name = malloc(len);
+		if (!cost->name)
+			ksft_exit_fail_msg("Unable to allocate test costs\n");
+		snprintf(cost->name, len, "%s%s%s.%s", fixture,
+			 variant[0] ? "." : "", variant, test);
+		cost->wall_ns = strtoll(wall + strlen("\"wall_ns\":"), NULL, 10);
+	}
+	free(line);
+	fclose(fp);
+
+	qsort(__test_costs, __test_cost_count, sizeof(*__test_costs),
+	      __test_cost_cmp);
+	return true;
+}
+
+static long long __job_cost(const struct __test_job *job)
+{
+	struct __test_cost key, *cost;
+	char name[1024];
+
+	snprintf(name, sizeof(name), "%s%s%s.%s", job->f->name,
+		 job->variant->name[0] ? "." : "", job->variant->name,
+		 job->t.name);
+	key.name = name;
+	cost = bsearch(&key, __test_costs, __test_cost_count,
+		       sizeof(*__test_costs), __test_cost_cmp);
+	return cost ? cost->wall_ns : -1;
 }
 
-static int test_harness_run(int __attribute__((unused)) argc,
-			    char __attribute__((unused)) **argv)
+/*
+ * --shard=K/N: shard K (counting from 0 here) runs a contiguous slice
+ * of the selected tests, so the TAP of shards 1..N concatenated in
+ * order numbers every test just as one unsharded run would. The slices
+ * are cut where the running total of test costs crosses each K/N of
+ * the whole. A test missing from --costs (or every test, without it)
+ * costs the mean of the known ones, so without --costs this is a split
+ * by count.
+ */
+static void __shard_range(const struct __test_job *jobs, unsigned int count,
+			  unsigned int shard, unsigned int shards,
+			  unsigned int *first, unsigned int *last)
 {
+	double total = 0, known = 0, sum = 0, mean = 1;
+	bool by_count;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].cost_ns < 0)
+			continue;
+		sum += jobs[i].cost_ns;
+		known++;
+	}
+	if (known && sum > 0)
+		mean = sum / known;
+	for (i = 0; i < count; i++)
+		total += jobs[i].cost_ns < 0 ? mean : jobs[i].cost_ns;
+	/* Every test recorded as taking no time at all. */
+	by_count = total <= 0;
+	if (by_count)
+		total = count;
+
+	*first = *last = count;
+	sum = 0;
+	for (i = 0; i < count; i++) {
+		if (*first == count && sum * shards >= total * shard)
+			*first = i;
+		if (sum * shards >= total * (shard + 1)) {
+			*last = i;
+			break;
+		}
+		if (by_count)
+			sum++;
+		else
+			sum += jobs[i].cost_ns < 0 ? mean : jobs[i].cost_ns;
+	}
+}
+
+/* --list-json: one JSON object per selected test, with its cost. */
+static void __list_json(const struct __test_job *jobs, unsigned int count)
+{
+	struct __th_writer *w;
+	unsigned int i;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		ksft_exit_fail_msg("Unable to allocate output buffer\n");
+	w->fd = STDOUT_FILENO;
+	w->len = 0;
+	for (i = 0; i < count; i++) {
+		__th_printf(w, "{\"number\":%u,\"fixture\":", jobs[i].number);
+		__th_puts_json(w, jobs[i].f->name);
+		__th_printf(w, ",\"variant\":");
+		__th_puts_json(w, jobs[i].variant->name);
+		__th_printf(w, ",\"test\":");
+		__th_puts_json(w, jobs[i].t.name);
+		if (jobs[i].cost_ns < 0)
+			__th_printf(w, ",\"cost_ns\":null}\n");
+		else
+			__th_printf(w, ",\"cost_ns\":%lld}\n", jobs[i].cost_ns);
+	}
+	__th_flush(w);
+	free(w);
+}
+
+static void __usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-h] [-l] [-j jobs] [-o format:file] [-f|-F fixture] [-v|-V variant] [-t|-T test] [-r regex] [--shard=K/N] [--costs=file] [--list-json] [--cache] [-q] [--no-capture] [--stats]\n"
+		"\t-h\t\tprint this help\n"
+		"\t-l\t\tlist the selected tests instead of running them\n"
+		"\t-j jobs\t\trun up to this many tests at once (0: one per CPU)\n"
+		"\t-o json:file\twrite results to file as JSON Lines\n"
+		"\t-o junit:file\twrite results to file as JUnit XML\n"
+		"\t-f fixture\tinclude fixtures matching this glob\n"
+		"\t-F fixture\texclude fixtures matching this glob\n"
+		"\t-v variant\tinclude variants matching this glob\n"
+		"\t-V variant\texclude variants matching this glob\n"
+		"\t-t test\t\tinclude tests matching this glob\n"
+		"\t-T test\t\texclude tests matching this glob\n"
+		"\t-r regex\tinclude tests whose fixture.variant.test matches\n"
+		"\t--shard=K/N\trun only the Kth of N slices of the selected tests\n"
+		"\t--costs=file\tbalance slices by the wall times in an earlier -o json:file\n"
+		"\t--list-json\tlist the selected tests as JSON Lines, with their costs\n"
+		"\t--cache\t\treuse (and add to) passes and xfails in ~/" TH_CACHE_DIR "\n"
+		"\t-q\t\tonly print the output of tests that do not pass\n"
+		"\t--no-capture\tlet tests write to stdout and stderr as they run\n"
+		"\t--stats\t\tprint spawn times and resource usage, once done\n"
+		"Each selector may be repeated; inclusions of the same kind are\n"
+		"combined, different kinds must all match.\n"
+		"Shards number their results as a single run would: the TAP output\n"
+		"of shards 1 to N, concatenated in that order, is one TAP stream.\n",
+		argv0);
+}
+
+static int test_harness_run(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "list", no_argument, NULL, 'l' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "fixture", required_argument, NULL, 'f' },
+		{ "no-fixture", required_argument, NULL, 'F' },
+		{ "variant", required_argument, NULL, 'v' },
+		{ "no-variant", required_argument, NULL, 'V' },
+		{ "test", required_argument, NULL, 't' },
+		{ "no-test", required_argument, NULL, 'T' },
+		{ "regex", required_argument, NULL, 'r' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "shard", required_argument, NULL, __OPT_SHARD },
+		{ "costs", required_argument, NULL, __OPT_COSTS },
+		{ "list-json", no_argument, NULL, __OPT_LIST_JSON },
+		{ "cache", no_argument, NULL, __OPT_CACHE },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "no-capture", no_argument, NULL, __OPT_NO_CAPTURE },
+		{ "stats", no_argument, NULL, __OPT_STATS },
+		{ }
+	};
+	struct __test_filter *filter;
+	bool list = false, list_json = false, cache = false, stats = false;
+	unsigned int cached = 0;
+	uint64_t dropped;
+	unsigned int shard = 0, shards = 0, first = 0, last;
+	const char *costs = NULL;
+	char extra;
+	long long spawn_total = 0, spawn_max = 0;
 	struct __fixture_variant_metadata no_variant = { .name = "", };
-	struct __fixture_variant_metadata *v;
-	struct __fixture_metadata *f;
+	struct __fixture_variant_metadata *no_variants[] = { &no_variant };
+	struct __fixture_variant_metadata **variants, *v;
+	struct __fixture_metadata **fp, *f;
+	unsigned int i, j, nr_variants, selected;
 	struct __test_results *results;
 	struct __test_metadata *t;
+	struct __test_job *jobs, *job;
+	size_t shm_size;
 	int ret = 0;
 	unsigned int case_count = 0, test_count = 0;
 	unsigned int count = 0;
 	unsigned int pass_count = 0;
+	unsigned int started = 0, reported = 0, nrunning = 0;
+	unsigned int total = 0;
+	int opt, err;
+
+	__test_filters = calloc(argc, sizeof(*__test_filters));
+	if (!__test_filters)
+		ksft_exit_fail_msg("Unable to allocate test filters\n");
+
+	while ((opt = getopt_long(argc, argv, "hlqj:o:f:F:v:V:t:T:r:",
+				  opts, NULL)) != -1) {
+		switch (opt) {
+		case 'l':
+			list = true;
+			break;
+		case 'q':
+			__test_quiet = true;
+			break;
+		case 'o':
+			if (!strncmp(optarg, "json:", 5)) {
+				__th_close(&__th_json);
+				__th_json = __th_open(optarg + 5, O_TRUNC);
+				if (__th_json)
+					break;
+			} else if (!strncmp(optarg, "junit:", 6)) {
+				__th_close(&__th_junit);
+				__th_junit = __th_open(optarg + 6, O_TRUNC);
+				if (__th_junit)
+					break;
+			} else {
+				__usage(argv[0]);
+				return KSFT_FAIL;
+			}
+			fprintf(stderr, "%s: %s: %s\n", argv[0],
+				strchr(optarg, ':') + 1, strerror(errno));
+			return KSFT_FAIL;
+		case 'f': case 'F':
+		case 'v': case 'V':
+		case 't': case 'T':
+		case 'r':
+			filter = &__test_filters[__test_filter_count++];
+			filter->kind = opt;
+			filter->pattern = optarg;
+			if (opt != 'r')
+				break;
+			err = regcomp(&filter->re, optarg, REG_EXTENDED | REG_NOSUB);
+			if (err) {
+				char msg[256];
+
+				regerror(err, &filter->re, msg, sizeof(msg));
+				fprintf(stderr, "%s: bad regex '%s': %s\n",
+					argv[0], optarg, msg);
+				return KSFT_FAIL;
+			}
+			break;
+		case 'j':
+			__test_jobs = atoi(optarg);
+			if (__test_jobs <= 0)
+				__test_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			if (__test_jobs <= 0)
+				__test_jobs = 1;
+			break;
+		case __OPT_SHARD:
+			if (sscanf(optarg, "%u/%u%c", &shard, &shards,
+				   &extra) != 2 || !shard || shard > shards) {
+				fprintf(stderr, "%s: bad shard '%s': want K/N with 1 <= K <= N\n",
+					argv[0], optarg);
+				return KSFT_FAIL;
+			}
+			shard--;
+			break;
+		case __OPT_COSTS:
+			costs = optarg;
+			break;
+		case __OPT_LIST_JSON:
+			list_json = true;
+			break;
+		case __OPT_CACHE:
+			cache = true;
+			break;
+		case __OPT_NO_CAPTURE:
+			__test_capture = false;
+			break;
+		case __OPT_STATS:
+			stats = true;
+			break;
+		case 'h':
+			__usage(argv[0]);
+			return KSFT_PASS;
+		default:
+			__usage(argv[0]);
+			return KSFT_FAIL;
+		}
+	}
 
-	for (f = __fixture_list; f; f = f->next) {
-		for (v = f->variant ?: &no_variant; v; v = v->next) {
-			case_count++;
-			for (t = f->tests; t; t = t->next)
-				test_count++;
+	__test_registry_init();
+	for (fp = __start_ksft_fixtures; fp < __stop_ksft_fixtures; fp++)
+		total += (*fp)->nr_tests * ((*fp)->nr_variants ?: 1);
+
+	/* Resolve the selection up front, so nothing is forked for it. */
+	jobs = calloc(total, sizeof(*jobs));
+	if (total && !jobs)
+		ksft_exit_fail_msg("Unable to allocate %u test jobs\n", total);
+	for (fp = __start_ksft_fixtures; fp < __stop_ksft_fixtures; fp++) {
+		f = *fp;
+		variants = f->nr_variants ? f->variants : no_variants;
+		nr_variants = f->nr_variants ?: 1;
+		for (i = 0; i < nr_variants; i++) {
+			v = variants[i];
+			for (j = 0; j < f->nr_tests; j++) {
+				t = f->tests[j];
+				if (!__test_selected(f, v, t))
+					continue;
+				job = &jobs[test_count++];
+				job->f = f;
+				job->variant = v;
+				job->t = *t;
+				job->cost_ns = -1;
+			}
 		}
 	}
 
-	results = mmap(NULL, sizeof(*results), PROT_READ | PROT_WRITE,
-		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (costs) {
+		if (!__load_costs(costs)) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], costs,
+				strerror(errno));
+			return KSFT_FAIL;
+		}
+		for (job = jobs; job < jobs + test_count; job++)
+			job->cost_ns = __job_cost(job);
+	}
+
+	selected = test_count;
+	if (shards) {
+		__shard_range(jobs, test_count, shard, shards, &first, &last);
+		memmove(jobs, jobs + first, (last - first) * sizeof(*jobs));
+		test_count = last - first;
+	}
+	for (i = 0; i < test_count; i++) {
+		jobs[i].number = first + i + 1;
+		if (!i || jobs[i].f != jobs[i - 1].f ||
+		    jobs[i].variant != jobs[i - 1].variant)
+			case_count++;
+	}
+
+	if (list_json) {
+		__list_json(jobs, test_count);
+		free(jobs);
+		return KSFT_PASS;
+	}
+	if (list) {
+		for (job = jobs; job < jobs + test_count; job++)
+			printf("%s%s%s.%s\n", job->f->name,
+			       job->variant->name[0] ? "." : "",
+			       job->variant->name, job->t.name);
+		free(jobs);
+		return KSFT_PASS;
+	}
 
-	ksft_print_header();
-	ksft_set_plan(test_count);
+	/*
+	 * One shared region per run: the ring, then a result slot for each
+	 * job. Step and reason stay in the slots, where a child can still
+	 * leave them when the ring is full.
+	 */
+	shm_size = sizeof(*__test_ring) + test_count * sizeof(*results);
+	__test_ring = mmap(NULL, shm_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (__test_ring == MAP_FAILED)
+		ksft_exit_fail_msg("Unable to allocate %u test slots\n",
+				   test_count);
+	results = (struct __test_results *)(__test_ring + 1);
+	for (count = 0; count < test_count; count++)
+		jobs[count].t.results = &results[count];
+
+	if (cache)
+		cached = __cache_open(argv[0], jobs, test_count);
+
+	__test_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (__test_epoll < 0)
+		ksft_exit_fail_msg("epoll_create1: %s\n", strerror(errno));
+
+	/*
+	 * A shard's results are numbered after those of earlier shards,
+	 * and only the first shard starts the TAP stream with a header and
+	 * the plan for the whole selection.
+	 */
+	ksft_test_base = first;
+	if (!shard) {
+		ksft_print_header();
+		ksft_set_plan(selected);
+	}
+	ksft_plan = test_count;
+	if (shards && !test_count)
+		ksft_print_msg("Shard %u/%u: no tests of %u.\n", shard + 1,
+			       shards, selected);
+	else if (shards)
+		ksft_print_msg("Shard %u/%u: tests %u-%u of %u.\n", shard + 1,
+			       shards, first + 1, first + test_count, selected);
 	ksft_print_msg("Starting %u tests from %u test cases.\n",
 	       test_count, case_count);
-	for (f = __fixture_list; f; f = f->next) {
-		for (v = f->variant ?: &no_variant; v; v = v->next) {
-			for (t = f->tests; t; t = t->next) {
-				count++;
-				t->results = results;
-				__run_test(f, v, t);
-				t->results = NULL;
-				if (t->passed)
-					pass_count++;
-				else
-					ret = 1;
-			}
+	if (__th_junit) {
+		__th_printf(__th_junit, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			    "<testsuites>\n<testsuite name=\"");
+		__th_puts_xml(__th_junit, argv[0]);
+		__th_printf(__th_junit, "\" tests=\"%u\">\n", test_count);
+	}
+
+	/*
+	 * Keep up to __test_jobs children running, but report results
+	 * strictly in declaration order so output matches a serial run.
+	 */
+	while (reported < count) {
+		while (started < count && nrunning < __test_jobs) {
+			job = &jobs[started];
+			if (started == reported)
+				__announce_test(job);
+			__start_test(job, started++);
+			spawn_total += job->spawn_ns;
+			if (job->spawn_ns > spawn_max)
+				spawn_max = job->spawn_ns;
+			if (!job->done)
+				nrunning++;
+		}
+
+		if (!jobs[reported].done) {
+			if (!__wait_for_test(jobs))
+				ksft_exit_fail_msg("waiting for tests: %s\n",
+						   strerror(errno));
+			if (!--nrunning)
+				__ring_drain(jobs, true);
 		}
+
+		while (reported < count && jobs[reported].done) {
+			job = &jobs[reported++];
+			if (!job->announced)
+				__announce_test(job);
+			__report_test(job);
+			if (job->t.passed)
+				pass_count++;
+			else
+				ret = 1;
+		}
+		if (reported < count && jobs[reported].started &&
+		    !jobs[reported].announced)
+			__announce_test(&jobs[reported]);
 	}
-	munmap(results, sizeof(*results));
+
+	if (__th_junit)
+		__th_printf(__th_junit, "</testsuite>\n</testsuites>\n");
+	__th_close(&__th_json);
+	__th_close(&__th_junit);
+	if (__cache_fd >= 0)
+		close(__cache_fd);
+	close(__test_epoll);
+	dropped = __test_ring->dropped;
+	munmap(__test_ring, shm_size);
+	__test_ring = NULL;
+
+	if (stats && count > cached)
+		ksft_print_msg("Spawned %u tests: %lld ns average, %lld ns max\n",
+			       count - cached, spawn_total / (count - cached),
+			       spawn_max);
+	if (cached)
+		ksft_print_msg("Reported %u tests from the result cache.\n",
+			       cached);
+	/*
+	 * Logs that didn't fit were printed straight away, but the EXPECT
+	 * counts and phase times (test_ns -1 in -o json) are gone.
+	 */
+	if (dropped)
+		ksft_print_msg("Dropped %llu messages: the ring (TH_RING_RECORDS %u) was full.\n",
+			       (unsigned long long)dropped,
+			       (unsigned int)TH_RING_RECORDS);
+	if (stats && count)
+		__report_rusage(jobs, count);
+	free(jobs);
 
 	ksft_print_msg("%s: %u / %u tests passed.\n", ret ? "FAILED" : "PASSED",
 			pass_count, count);
@@ -1130,10 +2824,4 @@ static int test_harness_run(int __attribute__((unused)) argc,
 	return KSFT_FAIL;
 }
 
-static void __attribute__((constructor)) __constructor_order_first(void)
-{
-	if (!__constructor_order)
-		__constructor_order = _CONSTRUCTOR_ORDER_FORWARD;
-}
-
 #endif  /* __KSELFTEST_HARNESS_H */
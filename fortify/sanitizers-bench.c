@@ -0,0 +1,182 @@
+/*
+ * Measure what the arithmetic overflow and truncation sanitizers cost
+ * on simple element-wise loops, using the same UBSAN_TESTS matrix as
+ * the sanitizers tests. See Makefile: one binary is built per sanitizer
+ * configuration, and each prints one row per distinct "t0 = t1 op t2"
+ * expression in the matrix.
+ *
+ * Every expression is timed twice: as the compiler would normally build
+ * the loop, and with loop vectorization disabled. A vec/scalar ratio
+ * near 1.0 where the unsanitized build shows a clear win means the
+ * inserted checks stopped the loop from being vectorized.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "sanitizers.h"
+
+#ifndef BENCH_CONFIG
+# define BENCH_CONFIG	"default"
+#endif
+
+/* Elements per loop. */
+#define BENCH_N		4096
+
+/*
+ * With BENCH_WRAPS, every operand and result is declared through a
+ * wrapping typedef, so the sanitizers should drop their checks again.
+ */
+#ifdef BENCH_WRAPS
+typedef u8  wrapping_u8  __wraps;
+typedef s8  wrapping_s8  __wraps;
+typedef u16 wrapping_u16 __wraps;
+typedef s16 wrapping_s16 __wraps;
+typedef u32 wrapping_u32 __wraps;
+typedef s32 wrapping_s32 __wraps;
+typedef u64 wrapping_u64 __wraps;
+typedef s64 wrapping_s64 __wraps;
+# define BENCH_T(t)	__PASTE(wrapping_, t)
+#else
+# define BENCH_T(t)	t
+#endif
+
+/* Build a loop, or a whole function, without loop vectorization. */
+#ifdef __clang__
+# define novec_fn
+# define novec_loop	_Pragma("clang loop vectorize(disable) interleave(disable)")
+#else
+# define novec_fn	__attribute__((__optimize__("no-tree-vectorize")))
+# define novec_loop
+#endif
+
+/* Malloced, so any element type may live in them. */
+static void *dst, *src1, *src2;
+
+struct bench_op {
+	const char *expr;
+	void (*vec)(struct bench_result *r);
+	void (*scalar)(struct bench_result *r);
+	struct bench_op *next;
+};
+
+static struct bench_op *bench_ops, **bench_ops_tail = &bench_ops;
+
+/* The matrix repeats expressions with different inputs; keep the first. */
+static void bench_register(const char *expr,
+			   void (*vec)(struct bench_result *),
+			   void (*scalar)(struct bench_result *))
+{
+	struct bench_op *op;
+
+	for (op = bench_ops; op; op = op->next)
+		if (!strcmp(op->expr, expr))
+			return;
+
+	op = calloc(1, sizeof(*op));
+	if (!op) {
+		perror("calloc");
+		exit(1);
+	}
+	op->expr = expr;
+	op->vec = vec;
+	op->scalar = scalar;
+	*bench_ops_tail = op;
+	bench_ops_tail = &op->next;
+}
+
+/*
+ * The loop gets restrict parameters of its own so the compiler is free
+ * to vectorize it without runtime alias checks. Inputs stay small enough
+ * that nothing in the matrix overflows or truncates: only the cost of
+ * the checks is measured, never a trap.
+ */
+#define BENCH_OP_FN(id, attr, pragma, t0, t1, op, t2)			\
+static noinline attr void __PASTE(id, _loop)(BENCH_T(t0) *restrict d,	\
+					     const BENCH_T(t1) *restrict a, \
+					     const BENCH_T(t2) *restrict b) \
+{									\
+	int i;								\
+									\
+	pragma								\
+	for (i = 0; i < BENCH_N; i++)					\
+		d[i] = a[i] oper(op) b[i];				\
+}									\
+									\
+static noinline void id(struct bench_result *r)				\
+{									\
+	BENCH_T(t1) *a = src1;						\
+	BENCH_T(t2) *b = src2;						\
+	int i;								\
+									\
+	for (i = 0; i < BENCH_N; i++) {					\
+		a[i] = 8 + (i & 7);					\
+		b[i] = i & 7;						\
+	}								\
+	barrier_data(a);						\
+	barrier_data(b);						\
+									\
+	BENCH_CYCLES(r, BENCH_N, {					\
+		__PASTE(id, _loop)(dst, a, b);				\
+		barrier_data(dst);					\
+	});								\
+}
+
+#define __BENCH_OP(id, t0, t1, op, t2)					\
+BENCH_OP_FN(id, , , t0, t1, op, t2)					\
+BENCH_OP_FN(__PASTE(id, _scalar), novec_fn, novec_loop, t0, t1, op, t2) \
+static void __attribute__((constructor)) __PASTE(id, _register)(void)	\
+{									\
+	bench_register(#t0 " = " #t1 " " oper_name(op) " " #t2,		\
+		       id, __PASTE(id, _scalar));			\
+}
+
+/* Only the integer matrix is benchmarked; pointer tests just trap. */
+#define UBSAN_trap_TEST(how, t0, t1, t1_init, op, t2, t2_init)
+#define UBSAN_TEST(how, t0, t1, t1_init, op, t2, t2_init)		\
+	__BENCH_OP(__UNIQUE_ID(bench), t0, t1, op, t2)
+
+UBSAN_TESTS
+
+static void *alloc_elems(void)
+{
+	void *p = calloc(BENCH_N, sizeof(u64));
+
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+int main(void)
+{
+	struct bench_result vec, scalar;
+	struct bench_op *op;
+
+	dst = alloc_elems();
+	src1 = alloc_elems();
+	src2 = alloc_elems();
+
+	printf("# sanitizers-bench: " __VERSION__ "\n");
+#ifdef BENCH_WRAPS
+	if (!CHECK_WRAPS_ATTR)
+		printf("# 'wraps' attribute not supported: same as unannotated\n");
+#endif
+	printf("# %-14s %-20s %10s %8s %10s %8s %7s\n", "config", "expression",
+	       "vec", "+-95%", "scalar", "+-95%", "ratio");
+	printf("# %-14s %-20s %10s %8s %10s %8s %7s\n", "", "",
+	       BENCH_CYCLE_UNIT "/elem", "", BENCH_CYCLE_UNIT "/elem", "", "");
+
+	for (op = bench_ops; op; op = op->next) {
+		op->vec(&vec);
+		op->scalar(&scalar);
+		printf("%-16s %-20s %10.3f %8.3f %10.3f %8.3f %7.2f\n",
+		       BENCH_CONFIG, op->expr, vec.mean, vec.ci95,
+		       scalar.mean, scalar.ci95, vec.mean / scalar.mean);
+	}
+
+	return 0;
+}